@@ -67,11 +67,67 @@ struct ARMSOCDRI2BufferRec {
 	 * Number of Pixmaps to use.
 	 *
 	 * This allows the number of back buffers used to be reduced, for
-	 * example when allocation fails. It cannot be changed to increase the
-	 * number of buffers as we would overflow the pPixmaps array.
+	 * example when allocation fails. With adaptive buffering it is also
+	 * grown and shrunk at runtime, but never beyond maxPixmaps as we would
+	 * overflow the pPixmaps array.
 	 */
 	unsigned numPixmaps;
 
+	/**
+	 * Upper bound for numPixmaps. Starts out as the size of the pPixmaps
+	 * array and is lowered if an allocation fails, so that we don't keep
+	 * trying to grow into memory we can't get.
+	 */
+	unsigned maxPixmaps;
+
+	/**
+	 * Number of flips scheduled from this buffer that have not yet
+	 * completed.
+	 */
+	int pending_flips;
+
+	/**
+	 * Adaptive buffering statistics for the current evaluation window:
+	 * the number of flips scheduled, how many of them came after the
+	 * client had been kept waiting for a free buffer and then missed a
+	 * frame, and how many found nothing in flight without the client
+	 * having waited (so the extra buffers were not needed).
+	 */
+	unsigned windowSwaps;
+	unsigned windowStalls;
+	unsigned windowIdle;
+
+	/**
+	 * Whether the swap chain was full when the last flip from this
+	 * buffer completed, so that the client was waiting on it, and the
+	 * vblank it completed in.
+	 */
+	Bool flipBlocked;
+	uint64_t flipMsc;
+
+	/**
+	 * Evaluation windows to skip after the number of back buffers has
+	 * changed, whether the drawable has been shrunk, and whether a
+	 * shrink has been undone by a grow since, in which case the
+	 * drawable isn't shrunk again.
+	 */
+	unsigned adaptHoldoff;
+	Bool adaptShrunk;
+	Bool adaptPinned;
+
+	/**
+	 * Time (in milliseconds) of the last swap from this buffer. Back
+	 * buffers that have not been swapped for a while have their extra
+	 * pixmaps released, see trimIdleBuffers().
+	 */
+	CARD32 lastSwap;
+
+	/**
+	 * Links in the list of back buffers that can be trimmed when idle.
+	 */
+	struct ARMSOCDRI2BufferRec *idlePrev;
+	struct ARMSOCDRI2BufferRec *idleNext;
+
 	/**
 	 * The DRI2 buffers are reference counted to avoid crashyness when the
 	 * client detaches a dri2 drawable while we are still waiting for a
@@ -174,6 +230,107 @@ canexchange(DrawablePtr pDraw, struct armsoc_bo *src_bo, struct armsoc_bo *dst_b
 	return ret;
 }
 
+/**
+ * The swap limit for a back buffer: one outstanding swap per back pixmap in
+ * use, plus one for early display, bounded by the size of the swap chain.
+ */
+static int
+swapLimit(struct ARMSOCRec *pARMSOC, struct ARMSOCDRI2BufferRec *buf)
+{
+	unsigned limit = buf->numPixmaps;
+
+	if (pARMSOC->drmmode_interface->use_early_display)
+		limit++;
+
+	return min(limit, pARMSOC->swap_chain_size);
+}
+
+/* How often the idle back buffers are looked for, in milliseconds */
+#define ARMSOC_IDLE_CHECK_INTERVAL 1000
+
+/**
+ * Release the extra back pixmaps of drawables that have not swapped for
+ * DRI2IdleTimeout seconds. Only the current pixmap is kept (in slot 0) so
+ * the DRI2 buffer name stays valid; the other slots are re-allocated
+ * lazily by nextBuffer() once the drawable starts swapping again.
+ */
+static CARD32
+trimIdleBuffers(OsTimerPtr timer, CARD32 now, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2BufferRec *buf;
+	unsigned i;
+
+	for (buf = pARMSOC->idle_buffers; buf; buf = buf->idleNext) {
+		ScreenPtr pScreen;
+		unsigned freed = 0;
+
+		if (buf->pending_flips > 0 ||
+		    (CARD32)(now - buf->lastSwap) <
+				pARMSOC->driIdleTimeout * 1000)
+			continue;
+
+		pScreen = buf->pPixmaps[buf->currentPixmap]->drawable.pScreen;
+		exchange(buf->pPixmaps[0], buf->pPixmaps[buf->currentPixmap]);
+		buf->currentPixmap = 0;
+
+		for (i = 1; i < buf->maxPixmaps; i++) {
+			if (!buf->pPixmaps[i])
+				continue;
+			ARMSOCDeregisterExternalAccess(buf->pPixmaps[i]);
+			pScreen->DestroyPixmap(buf->pPixmaps[i]);
+			buf->pPixmaps[i] = NULL;
+			freed++;
+		}
+
+		if (freed) {
+			pARMSOC->idle_trims++;
+			DEBUG_MSG("Released %d idle back buffers of DRI2 buffer %p",
+					freed, buf);
+		}
+	}
+
+	return pARMSOC->idle_buffers ? ARMSOC_IDLE_CHECK_INTERVAL : 0;
+}
+
+static void
+trackIdleBuffer(ScrnInfoPtr pScrn, struct ARMSOCDRI2BufferRec *buf)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (!pARMSOC->driIdleTimeout || buf->maxPixmaps <= 1)
+		return;
+
+	buf->lastSwap = GetTimeInMillis();
+	buf->idlePrev = NULL;
+	buf->idleNext = pARMSOC->idle_buffers;
+	if (buf->idleNext)
+		buf->idleNext->idlePrev = buf;
+	else
+		pARMSOC->idle_timer = TimerSet(pARMSOC->idle_timer, 0,
+				ARMSOC_IDLE_CHECK_INTERVAL, trimIdleBuffers, pScrn);
+	pARMSOC->idle_buffers = buf;
+}
+
+static void
+untrackIdleBuffer(ScrnInfoPtr pScrn, struct ARMSOCDRI2BufferRec *buf)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (buf->idlePrev)
+		buf->idlePrev->idleNext = buf->idleNext;
+	else if (pARMSOC->idle_buffers == buf)
+		pARMSOC->idle_buffers = buf->idleNext;
+	else
+		return; /* not tracked */
+
+	if (buf->idleNext)
+		buf->idleNext->idlePrev = buf->idlePrev;
+	buf->idlePrev = NULL;
+	buf->idleNext = NULL;
+}
+
 static Bool create_buffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *buf)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
@@ -200,9 +357,14 @@ static Bool create_buffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *buf)
 	if (buffer->attachment == DRI2BufferBackLeft && pARMSOC->driNumBufs > 2) {
 		buf->pPixmaps = calloc(pARMSOC->driNumBufs-1,
 				sizeof(PixmapPtr));
-		buf->numPixmaps = pARMSOC->driNumBufs-1;
+		buf->maxPixmaps = pARMSOC->driNumBufs-1;
+		/* With adaptive buffering start out double buffered and
+		 * only grow the chain if the client turns out to need it */
+		buf->numPixmaps = pARMSOC->driAdaptiveBufs ?
+				1 : buf->maxPixmaps;
 	} else {
 		buf->pPixmaps = malloc(sizeof(PixmapPtr));
+		buf->maxPixmaps = 1;
 		buf->numPixmaps = 1;
 	}
 
@@ -234,21 +396,22 @@ static Bool create_buffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *buf)
 	}
 
 	if (canflip(pDraw) && buffer->attachment != DRI2BufferFrontLeft) {
-		/* Create an fb around this buffer. This will fail and we will
-		 * fall back to blitting if the display controller hardware
-		 * cannot scan out this buffer (for example, if it doesn't
-		 * support the format or there was insufficient scanout memory
-		 * at buffer creation time). */
-		int ret = armsoc_bo_add_fb(bo);
+		/* Create an fb around this buffer, unless it came from the
+		 * scanout pool with one attached already. This will fail and
+		 * we will fall back to blitting if the display controller
+		 * hardware cannot scan out this buffer (for example, if it
+		 * doesn't support the format or there was insufficient scanout
+		 * memory at buffer creation time). */
+		int ret = armsoc_bo_get_fb(bo) ? 0 : armsoc_bo_add_fb(bo);
 		if (ret) {
 			WARNING_MSG(
 					"Falling back to blitting a flippable window");
 		}
 #if DRI2INFOREC_VERSION >= 6
-		else if (FALSE == DRI2SwapLimit(pDraw, pARMSOC->swap_chain_size)) {
+		else if (FALSE == DRI2SwapLimit(pDraw, swapLimit(pARMSOC, buf))) {
 			WARNING_MSG(
 				"Failed to set DRI2SwapLimit(%p,%d)",
-				pDraw, pARMSOC->swap_chain_size);
+				pDraw, swapLimit(pARMSOC, buf));
 		}
 #endif /* DRI2INFOREC_VERSION >= 6 */
 	}
@@ -259,6 +422,8 @@ static Bool create_buffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *buf)
 	 * so needs synchronised access */
 	ARMSOCRegisterExternalAccess(pPixmap);
 
+	trackIdleBuffer(pScrn, buf);
+
 	return TRUE;
 
 fail:
@@ -283,6 +448,8 @@ static Bool destroy_buffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *buf)
 	if (--buf->refcnt > 0)
 		return FALSE;
 
+	untrackIdleBuffer(pScrn, buf);
+
 	if (buffer->attachment == DRI2BufferBackLeft) {
 		assert(pARMSOC->driNumBufs > 1);
 		numBuffers = pARMSOC->driNumBufs-1;
@@ -412,6 +579,53 @@ ARMSOCDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	FreeScratchGC(pGC);
 }
 
+/**
+ * Per-window cache of the CRTC a window is shown on, so that we don't have
+ * to walk the CRTC list on every vblank query. It is refreshed when the
+ * window moves or is resized, or when the CRTC configuration changes.
+ */
+struct ARMSOCDRI2WindowRec {
+	xf86CrtcPtr crtc;
+	BoxRec box;
+	unsigned int serial;
+	Bool valid;
+};
+
+static DevPrivateKeyRec ARMSOCDRI2WindowPrivateKeyRec;
+
+/**
+ * Get the CRTC showing most of the drawable, or NULL if it isn't
+ * visible (in which case vblank requests go to the first CRTC).
+ */
+static xf86CrtcPtr
+drawableCrtc(DrawablePtr pDraw)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2WindowRec *priv;
+	BoxRec box;
+
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return NULL;
+
+	box.x1 = pDraw->x;
+	box.y1 = pDraw->y;
+	box.x2 = box.x1 + pDraw->width;
+	box.y2 = box.y1 + pDraw->height;
+
+	priv = dixGetPrivateAddr(&((WindowPtr)pDraw)->devPrivates,
+			&ARMSOCDRI2WindowPrivateKeyRec);
+	if (!priv->valid || priv->serial != pARMSOC->crtc_config_serial ||
+	    memcmp(&priv->box, &box, sizeof(box))) {
+		priv->crtc = drmmode_covering_crtc(pScrn, &box);
+		priv->box = box;
+		priv->serial = pARMSOC->crtc_config_serial;
+		priv->valid = TRUE;
+	}
+
+	return priv->crtc;
+}
+
 /**
  * Get current frame count and frame count timestamp, based on drawable's
  * crtc.
@@ -421,28 +635,17 @@ ARMSOCDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	drmVBlank vbl = { .request = {
-		.type = DRM_VBLANK_RELATIVE,
-		.sequence = 0,
-	} };
-	int ret;
-
-	if (!pARMSOC->drmmode_interface->vblank_query_supported)
-		return FALSE;
+	uint64_t vbl_ust, vbl_msc;
 
-	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
-	if (ret) {
-		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+	if (!drmmode_crtc_get_msc(pScrn, drawableCrtc(pDraw),
+			&vbl_ust, &vbl_msc))
 		return FALSE;
-	}
 
 	if (ust)
-		*ust = ((CARD64)vbl.reply.tval_sec * 1000000)
-			+ vbl.reply.tval_usec;
+		*ust = vbl_ust;
 
 	if (msc)
-		*msc = vbl.reply.sequence;
+		*msc = vbl_msc;
 
 	return TRUE;
 }
@@ -473,6 +676,7 @@ ARMSOCDRI2SwapLimitValidate(DrawablePtr pDraw, int swap_limit) {
 
 #define ARMSOC_SWAP_FAKE_FLIP (1 << 0)
 #define ARMSOC_SWAP_FAIL      (1 << 1)
+#define ARMSOC_SWAP_ASYNC     (1 << 2)
 
 struct ARMSOCDRISwapCmd {
 	int type;
@@ -492,6 +696,11 @@ struct ARMSOCDRISwapCmd {
 	struct armsoc_bo *old_dst_bo;  /* Swap chain holds ref on dst bo */
 	struct armsoc_bo *new_scanout; /* scanout to be used after swap */
 	unsigned int swap_id;
+	uint32_t fb_id; /* fb to flip to, for swaps parked in the mailbox */
+	/* vblank the swap completed in, from the last page flip event */
+	uint64_t frame;
+	unsigned int tv_sec;
+	unsigned int tv_usec;
 };
 
 static const char * const swap_names[] = {
@@ -504,6 +713,7 @@ struct ARMSOCDRIVBlankCmd {
 	int type;
 	ClientPtr client;
 	DrawablePtr pDraw;
+	xf86CrtcPtr crtc;
 };
 
 static Bool allocNextBuffer(DrawablePtr pDraw, PixmapPtr *ppPixmap,
@@ -604,10 +814,112 @@ static void nextBuffer(DrawablePtr pDraw, struct ARMSOCDRI2BufferRec *backBuf)
 				backBuf->numPixmaps+1,
 				backBuf->currentPixmap+2);
 			backBuf->numPixmaps = backBuf->currentPixmap+1;
+			backBuf->maxPixmaps = backBuf->numPixmaps;
+#if DRI2INFOREC_VERSION >= 6
+			DRI2SwapLimit(pDraw, swapLimit(pARMSOC, backBuf));
+#endif
 		}
 	}
 }
 
+/* Number of flips a drawable's back buffer count is evaluated over */
+#define ARMSOC_ADAPT_WINDOW 32
+
+/* Evaluation windows skipped after a change, while the client settles */
+#define ARMSOC_ADAPT_HOLDOFF 2
+
+/**
+ * Adapt the number of back buffers used by a flipping drawable.
+ *
+ * Called for each flip scheduled from the back buffer, before the flip
+ * itself is queued. A flip stalled if the swap chain was full when the
+ * previous one completed, so the client had been waiting for it, and this
+ * swap still came too late for the next vblank: with another back buffer
+ * the client would have started on the frame earlier. If at least half of
+ * the flips in a window stalled, one more back buffer is added (allocated
+ * lazily by nextBuffer()). If nearly all of them found nothing in flight
+ * without the client having waited, a back buffer is released again.
+ *
+ * A client slower than the display can meet both tests in turn; once a
+ * shrink has been undone by a grow the drawable keeps its buffers.
+ */
+static void adaptBufferCount(DrawablePtr pDraw,
+		struct ARMSOCDRI2BufferRec *buf)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	unsigned oldNumPixmaps = buf->numPixmaps;
+	CARD64 current_msc;
+	unsigned last;
+
+	if (!pARMSOC->driAdaptiveBufs || buf->maxPixmaps <= 1)
+		return;
+
+	buf->windowSwaps++;
+	if (buf->pending_flips == 0 && buf->flipBlocked) {
+		if (ARMSOCDRI2GetMSC(pDraw, NULL, &current_msc) &&
+		    current_msc > buf->flipMsc)
+			buf->windowStalls++;
+	} else if (buf->pending_flips == 0)
+		buf->windowIdle++;
+
+	if (buf->windowSwaps < ARMSOC_ADAPT_WINDOW)
+		return;
+
+	if (buf->adaptHoldoff) {
+		buf->adaptHoldoff--;
+	} else if (buf->windowStalls * 2 >= ARMSOC_ADAPT_WINDOW &&
+	    buf->numPixmaps < buf->maxPixmaps) {
+		if (buf->adaptShrunk)
+			buf->adaptPinned = TRUE;
+		buf->numPixmaps++;
+		buf->adaptHoldoff = ARMSOC_ADAPT_HOLDOFF;
+		pARMSOC->adaptive_grows++;
+		DEBUG_MSG("pDraw=%p: %d stalls in %d flips, growing to %d buffers",
+				pDraw, buf->windowStalls, buf->windowSwaps,
+				buf->numPixmaps + 1);
+	} else if (buf->windowIdle * 8 >= ARMSOC_ADAPT_WINDOW * 7 &&
+	    buf->numPixmaps > 1 && buf->pending_flips == 0 &&
+	    !buf->adaptPinned) {
+		PixmapPtr pVictim;
+
+		/* Nothing is in flight, so any pixmap other than the current
+		 * one can go. Keep the current one out of the last slot so
+		 * that the ring stays packed. */
+		last = buf->numPixmaps - 1;
+		if (buf->currentPixmap == last) {
+			exchange(buf->pPixmaps[last], buf->pPixmaps[last - 1]);
+			buf->currentPixmap = last - 1;
+		}
+		pVictim = buf->pPixmaps[last];
+		buf->pPixmaps[last] = NULL;
+		buf->numPixmaps--;
+		if (pVictim) {
+			ARMSOCDeregisterExternalAccess(pVictim);
+			pScreen->DestroyPixmap(pVictim);
+		}
+		buf->adaptHoldoff = ARMSOC_ADAPT_HOLDOFF;
+		buf->adaptShrunk = TRUE;
+		pARMSOC->adaptive_shrinks++;
+		DEBUG_MSG("pDraw=%p: %d idle in %d flips, shrinking to %d buffers",
+				pDraw, buf->windowIdle, buf->windowSwaps,
+				buf->numPixmaps + 1);
+	}
+
+	buf->windowSwaps = 0;
+	buf->windowStalls = 0;
+	buf->windowIdle = 0;
+
+#if DRI2INFOREC_VERSION >= 6
+	if (buf->numPixmaps != oldNumPixmaps &&
+	    FALSE == DRI2SwapLimit(pDraw, swapLimit(pARMSOC, buf))) {
+		WARNING_MSG("Failed to set DRI2SwapLimit(%p,%d)",
+			pDraw, swapLimit(pARMSOC, buf));
+	}
+#endif /* DRI2INFOREC_VERSION >= 6 */
+}
+
 static struct armsoc_bo *boFromBuffer(DRI2BufferPtr buf)
 {
 	PixmapPtr pPixmap;
@@ -669,8 +981,180 @@ ARMSOCDRI2ResizeSwapChain(ScrnInfoPtr pScrn, struct armsoc_bo *old_bo,
 		updateResizedBuffer(pScrn, cmd->pSrcBuffer, old_bo, resized_bo);
 		updateResizedBuffer(pScrn, cmd->pDstBuffer, old_bo, resized_bo);
 	}
+
+	cmd = pARMSOC->mailbox;
+	if (cmd) {
+		updateResizedBuffer(pScrn, cmd->pSrcBuffer, old_bo, resized_bo);
+		updateResizedBuffer(pScrn, cmd->pDstBuffer, old_bo, resized_bo);
+	}
 }
 
+/**
+ * Add a flip to the swap chain and queue it on the CRTCs. Returns the
+ * result of drmmode_page_flip(), with the swap count and flags of the
+ * command set up to match.
+ */
+static int
+queueFlip(DrawablePtr pDraw, struct ARMSOCDRISwapCmd *cmd, uint32_t fb_id)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	unsigned int idx;
+	Bool async = (cmd->flags & ARMSOC_SWAP_ASYNC) != 0;
+	int ret;
+
+	/* Add swap operation to the swap chain */
+	cmd->swap_id = pARMSOC->swap_chain_count++;
+	idx = cmd->swap_id % pARMSOC->swap_chain_size;
+	if (NULL != pARMSOC->swap_chain[idx])
+		WARNING_MSG("Flip is called too fast\n");
+	pARMSOC->swap_chain[idx] = cmd;
+	pARMSOC->pending_flips++;
+	ARMSOCBUF(cmd->pSrcBuffer)->pending_flips++;
+	ret = drmmode_page_flip(pDraw, fb_id, cmd, &async);
+
+	/* Flips that fell back to waiting for vblank have timestamps
+	 * worth keeping */
+	if (!async)
+		cmd->flags &= ~ARMSOC_SWAP_ASYNC;
+
+	/* If using page flip events, we'll trigger an immediate
+	 * completion in the case that no CRTCs were enabled to be
+	 * flipped. If not using page flip events, trigger immediate
+	 * completion unconditionally.
+	 */
+	if (ret < 0) {
+		cmd->flags |= ARMSOC_SWAP_FAIL;
+
+		if (pARMSOC->drmmode_interface->use_page_flip_events)
+			cmd->swapCount = -(ret + 1);
+		else
+			cmd->swapCount = 0;
+	} else {
+		if (ret == 0)
+			cmd->flags |= ARMSOC_SWAP_FAKE_FLIP;
+
+		if (pARMSOC->drmmode_interface->use_page_flip_events)
+			cmd->swapCount = ret;
+		else
+			cmd->swapCount = 0;
+	}
+
+	return ret;
+}
+
+/**
+ * Show the frame of a mailbox swap whose flip failed on every CRTC by
+ * copying it to the buffer being scanned out. The front buffer was given
+ * the frame's bo when the swap was parked, so it gets the scanout bo back
+ * from the back buffer that has had it since, which takes the frame's bo
+ * in turn. Returns FALSE if the scanout bo isn't one of the back buffers.
+ */
+static Bool
+blitMailbox(DrawablePtr pDraw, struct ARMSOCDRISwapCmd *cmd)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRI2BufferRec *back = ARMSOCBUF(cmd->pSrcBuffer);
+	PixmapPtr pFront = draw2pix(dri2draw(pDraw, cmd->pDstBuffer));
+	PixmapPtr pBack = NULL;
+	GCPtr pGC;
+	unsigned i;
+	int ret;
+
+	if (cmd->pSrcBuffer->attachment != DRI2BufferBackLeft)
+		return FALSE;
+
+	for (i = 0; i < back->numPixmaps; i++) {
+		if (back->pPixmaps[i] &&
+		    ARMSOCPixmapBo(back->pPixmaps[i]) == pARMSOC->scanout) {
+			pBack = back->pPixmaps[i];
+			break;
+		}
+	}
+	if (!pBack)
+		return FALSE;
+
+	pGC = GetScratchGC(pDraw->depth, pScreen);
+	if (!pGC)
+		return FALSE;
+
+	ARMSOCPixmapExchange(pFront, pBack);
+	if (i == back->currentPixmap) {
+		exchange(cmd->pSrcBuffer->name, cmd->pDstBuffer->name);
+	} else {
+		ret = armsoc_bo_get_name(pARMSOC->scanout,
+				&cmd->pDstBuffer->name);
+		assert(!ret);
+	}
+
+	ValidateGC(pDraw, pGC);
+	pGC->ops->CopyArea(&pBack->drawable, pDraw, pGC,
+			0, 0, pDraw->width, pDraw->height, 0, 0);
+	FreeScratchGC(pGC);
+	return TRUE;
+}
+
+/**
+ * Flip to the swap parked in the mailbox, now that the previous flip has
+ * completed. Its buffers were exchanged when it was scheduled, so all that
+ * is left is to queue the flip.
+ */
+static void
+flipMailbox(ScrnInfoPtr pScrn)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct ARMSOCDRISwapCmd *cmd = pARMSOC->mailbox;
+	DrawablePtr pDraw;
+	int status, ret;
+
+	pARMSOC->mailbox = NULL;
+
+	status = dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
+			M_ANY, DixWriteAccess);
+	if (status != Success) {
+		/* Drawable is gone, nobody is waiting for this swap */
+		cmd->type = DRI2_EXCHANGE_COMPLETE;
+		cmd->flags |= ARMSOC_SWAP_FAIL;
+		ARMSOCDRI2SwapComplete(cmd);
+		return;
+	}
+
+	ret = queueFlip(pDraw, cmd, cmd->fb_id);
+	if (ret == -1) {
+		/* No CRTC flipped, so the screen still shows the old
+		 * frame: copy the new one instead, or fail the swap */
+		if (blitMailbox(pDraw, cmd)) {
+			/* this is no flip after all: take it back off
+			 * the swap chain and complete it as a blit */
+			WARNING_MSG("Mailbox flip failed, copying the frame instead");
+			pARMSOC->swap_chain[cmd->swap_id %
+					pARMSOC->swap_chain_size] = NULL;
+			pARMSOC->swap_chain_count--;
+			pARMSOC->pending_flips--;
+			ARMSOCBUF(cmd->pSrcBuffer)->pending_flips--;
+			cmd->type = DRI2_BLIT_COMPLETE;
+			cmd->flags &= ~ARMSOC_SWAP_FAIL;
+			cmd->swapCount = 0;
+		} else {
+			/* queueFlip left the swap failed, with no flip
+			 * events to wait for */
+			ERROR_MSG("Mailbox flip and copy failed, dropping the frame");
+		}
+	} else if (ret < 0) {
+		/* Some CRTCs flipped and show the new frame already,
+		 * which a copy can't undo, so bring the others along
+		 * the slow way */
+		ERROR_MSG("Mailbox flip failed on some CRTCs, setting modes instead");
+		set_scanout_bo(pScrn, cmd->new_scanout);
+		xf86SetDesiredModes(pScrn);
+	}
+
+	if (cmd->swapCount == 0)
+		ARMSOCDRI2SwapComplete(cmd);
+}
 
 void
 ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
@@ -694,8 +1178,21 @@ ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 				M_ANY, DixWriteAccess);
 
 		if (status == Success) {
+			if (!cmd->tv_sec && !cmd->tv_usec) {
+				/* No flip event timestamp (blit, exchange or
+				 * flip that didn't reach a CRTC), so report the
+				 * vblank we are in now */
+				CARD64 ust, msc;
+
+				if (ARMSOCDRI2GetMSC(pDraw, &ust, &msc)) {
+					cmd->frame = msc;
+					cmd->tv_sec = ust / 1000000;
+					cmd->tv_usec = ust % 1000000;
+				}
+			}
 
-			DRI2SwapComplete(cmd->client, pDraw, 0, 0, 0, cmd->type,
+			DRI2SwapComplete(cmd->client, pDraw, cmd->frame,
+					cmd->tv_sec, cmd->tv_usec, cmd->type,
 					cmd->func, cmd->data);
 
 			if (cmd->type != DRI2_BLIT_COMPLETE &&
@@ -711,6 +1208,17 @@ ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 		ERROR_MSG("swap %d ARMSOC_SWAP_FAIL on swap complete", cmd->swap_id);
 	}
 
+	if (cmd->type == DRI2_FLIP_COMPLETE) {
+		struct ARMSOCDRI2BufferRec *src = ARMSOCBUF(cmd->pSrcBuffer);
+
+		/* With the swap chain full the client couldn't get a buffer
+		 * for its next frame until now */
+		src->flipBlocked = !(cmd->flags & ARMSOC_SWAP_FAIL) &&
+				src->pending_flips >= swapLimit(pARMSOC, src);
+		src->flipMsc = cmd->frame;
+		src->pending_flips--;
+	}
+
 	/* drop extra refcnt we obtained prior to swap:
 	 */
 	ARMSOCDRI2DestroyBuffer(pDraw, cmd->pSrcBuffer);
@@ -730,6 +1238,9 @@ ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd)
 		pARMSOC->swap_chain[idx] = NULL;
 	}
 	free(cmd);
+
+	if (pARMSOC->mailbox && pARMSOC->pending_flips == 0)
+		flipMailbox(pScrn);
 }
 
 /**
@@ -762,7 +1273,6 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	struct armsoc_bo *src_bo, *dst_bo;
 	int src_fb_id, dst_fb_id;
 	int ret, do_flip;
-	unsigned int idx;
 	RegionRec region;
 	PixmapPtr pDstPixmap = NULL;
 
@@ -772,6 +1282,7 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	}
 
 	pDstPixmap = draw2pix(dri2draw(pDraw, pDstBuffer));
+	src->lastSwap = GetTimeInMillis();
 
 	cmd = calloc(1, sizeof(*cmd));
 	if (!cmd)
@@ -856,48 +1367,75 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 		DEBUG_MSG("FLIPPING:  FB%d -> FB%d", src_fb_id, dst_fb_id);
 		cmd->type = DRI2_FLIP_COMPLETE;
 
-		/* Add swap operation to the swap chain */
-		cmd->swap_id = pARMSOC->swap_chain_count++;
-		idx = cmd->swap_id % pARMSOC->swap_chain_size;
-		if (NULL != pARMSOC->swap_chain[idx])
-			WARNING_MSG("Flip is called too fast\n");
-		pARMSOC->swap_chain[idx] = cmd;
+		if (pSrcBuffer->attachment == DRI2BufferBackLeft)
+			adaptBufferCount(pDraw, src);
+
+		if (pARMSOC->AsyncFlip && divisor == 0) {
+			CARD64 current_msc;
+
+			/* The vblank this swap was meant for has just gone by.
+			 * Rather than holding it back for another whole frame,
+			 * flip at once and accept tearing. A target more than a
+			 * frame old only means the client renders slower than
+			 * the refresh rate, so that swap waits for vblank as
+			 * usual, and the target is moved to the vblank the flip
+			 * will land on so the next one is measured from there. */
+			if (ARMSOCDRI2GetMSC(pDraw, NULL, &current_msc)) {
+				if (*target_msc == current_msc) {
+					DEBUG_MSG("Late swap (target %llu), flipping async",
+						(unsigned long long)*target_msc);
+					cmd->flags |= ARMSOC_SWAP_ASYNC;
+				} else if (*target_msc < current_msc) {
+					*target_msc = current_msc + 1;
+				}
+			}
+		}
+
+		if (pARMSOC->driMailbox && pARMSOC->pending_flips > 0 &&
+		    (!pARMSOC->mailbox ||
+		     pARMSOC->mailbox->draw_id == pDraw->id)) {
+			/* A flip is already on its way to the screen. Park this
+			 * swap until it has completed, replacing any swap that
+			 * was parked before and has not been flipped yet. */
+			exchangebufs(pDraw, pSrcBuffer, pDstBuffer);
+
+			cmd->fb_id = src_fb_id;
+			cmd->new_scanout = boFromBuffer(pDstBuffer);
+			if (pARMSOC->mailbox) {
+				struct ARMSOCDRISwapCmd *old = pARMSOC->mailbox;
+
+				/* The exchange put the superseded frame, which
+				 * never reaches the screen, in the back buffer.
+				 * The client renders its next frame there rather
+				 * than moving on round the ring, where the next
+				 * buffer may be the one being scanned out or the
+				 * one the pending flip shows next. So report the
+				 * old swap as exchanged. */
+				DEBUG_MSG("Mailbox swap superseded");
+				old->type = DRI2_EXCHANGE_COMPLETE;
+				ARMSOCDRI2SwapComplete(old);
+				pARMSOC->mailbox_superseded++;
+			} else if (pSrcBuffer->attachment == DRI2BufferBackLeft) {
+				nextBuffer(pDraw, ARMSOCBUF(pSrcBuffer));
+			}
+			pARMSOC->mailbox = cmd;
+			return TRUE;
+		}
+
 		/* TODO: MIDEGL-1461: Handle rollback if multiple CRTC flip is
 		 * only partially successful
 		 */
-		pARMSOC->pending_flips++;
-		ret = drmmode_page_flip(pDraw, src_fb_id, cmd);
-
-		/* If using page flip events, we'll trigger an immediate
-		 * completion in the case that no CRTCs were enabled to be
-		 * flipped. If not using page flip events, trigger immediate
-		 * completion unconditionally.
-		 */
+		ret = queueFlip(pDraw, cmd, src_fb_id);
 		if (ret < 0) {
 			/*
 			 * Error while flipping; bail.
 			 */
-			cmd->flags |= ARMSOC_SWAP_FAIL;
-
-			if (pARMSOC->drmmode_interface->use_page_flip_events)
-				cmd->swapCount = -(ret + 1);
-			else
-				cmd->swapCount = 0;
-
 			cmd->new_scanout = boFromBuffer(pDstBuffer);
 			if (cmd->swapCount == 0)
 				ARMSOCDRI2SwapComplete(cmd);
 
 			return FALSE;
 		} else {
-			if (ret == 0)
-				cmd->flags |= ARMSOC_SWAP_FAKE_FLIP;
-
-			if (pARMSOC->drmmode_interface->use_page_flip_events)
-				cmd->swapCount = ret;
-			else
-				cmd->swapCount = 0;
-
 			/* Flip successfully scheduled.
 			 * Now exchange bos between src and dst pixmaps
 			 * and select the next bo for the back buffer.
@@ -953,10 +1491,71 @@ ARMSOCDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	return TRUE;
 }
 
-void ARMSOCDRI2VBlankHandler(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+/**
+ * Called for each page flip event of a swap. The swap completes with the
+ * vblank counter and timestamp of the last CRTC to flip.
+ */
+void ARMSOCDRI2FlipHandler(unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	struct ARMSOCDRISwapCmd *cmd = user_data;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(cmd->pScreen);
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcPtr crtc;
+	uint64_t msc;
+
+	/* Report the same 64-bit count as GetMSC and WaitMSC. Events that
+	 * don't say which CRTC flipped are placed against the first one,
+	 * like vblank requests without a CRTC.
+	 */
+	crtc = drmmode_crtc_from_id(pScrn, crtc_id);
+	msc = drmmode_crtc_widen_msc(pScrn, crtc, sequence);
+
+	/* Async flips don't happen at vblank, so their timestamps say
+	 * nothing about the vblank clock.
+	 */
+	if (!(cmd->flags & ARMSOC_SWAP_ASYNC)) {
+		if (crtc)
+			drmmode_crtc_note_vblank(pScrn, crtc, msc,
+					(uint64_t)tv_sec * 1000000 + tv_usec);
+		else if (!pARMSOC->drmmode_interface->vblank_query_supported)
+			/* The software vblank clock only needs the time,
+			 * and flips go to every CRTC.
+			 */
+			drmmode_crtc_note_vblank(pScrn, NULL, sequence,
+					(uint64_t)tv_sec * 1000000 + tv_usec);
+	}
+
+	/* The hardware counter in the event means nothing to clients
+	 * timed by the software vblank source; report its count instead.
+	 */
+	if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		uint64_t ust;
+
+		drmmode_crtc_get_msc(pScrn, crtc, &ust, &msc);
+	}
+
+	cmd->frame = msc;
+	cmd->tv_sec = tv_sec;
+	cmd->tv_usec = tv_usec;
+	ARMSOCDRI2SwapComplete(cmd);
+}
+
+/**
+ * Called for the vblank event of a WaitMSC. Events from the legacy
+ * interface only carry the low 32 bits of the counter.
+ */
+void ARMSOCDRI2VBlankHandler(uint64_t msc, uint64_t ust, Bool legacy,
+		void *user_data)
 {
 	struct ARMSOCDRIVBlankCmd *cmd = (struct ARMSOCDRIVBlankCmd *)user_data;
-	DRI2WaitMSCComplete(cmd->client, cmd->pDraw, sequence, tv_sec, tv_usec);
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(cmd->pDraw->pScreen);
+
+	if (legacy)
+		msc = drmmode_crtc_widen_msc(pScrn, cmd->crtc, msc);
+	drmmode_crtc_note_vblank(pScrn, cmd->crtc, msc, ust);
+	DRI2WaitMSCComplete(cmd->client, cmd->pDraw, msc,
+			ust / 1000000, ust % 1000000);
 	free(cmd);
 }
 
@@ -972,27 +1571,20 @@ ARMSOCDRI2ScheduleWaitMSC(ClientPtr client, DrawablePtr pDraw,
 {
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	struct ARMSOCDRIVBlankCmd *cmd = NULL;
-	drmVBlank vbl = { .request = {
-		.type = DRM_VBLANK_RELATIVE,
-		.sequence = 0,
-	} };
-	int ret;
-	CARD64 current_msc;
+	xf86CrtcPtr crtc = drawableCrtc(pDraw);
+	uint64_t current_msc, current_ust;
 
-	if (!pARMSOC->drmmode_interface->vblank_query_supported)
-		return FALSE;
-
-	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
-	if (ret) {
-		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+	/* The current count comes from the vblank clock model. If it is
+	 * behind, the kernel completes the event for an already passed
+	 * target straight away, so this can't make us wait too long.
+	 */
+	if (!drmmode_crtc_get_msc(pScrn, crtc, &current_ust, &current_msc))
 		return FALSE;
-	}
-	current_msc = vbl.reply.sequence;
 
 	if (current_msc >= target_msc) {
-		DRI2WaitMSCComplete(client, pDraw, current_msc, 0, 0);
+		DRI2WaitMSCComplete(client, pDraw, current_msc,
+				current_ust / 1000000, current_ust % 1000000);
 		return TRUE;
 	}
 
@@ -1003,13 +1595,11 @@ ARMSOCDRI2ScheduleWaitMSC(ClientPtr client, DrawablePtr pDraw,
 	cmd->type = 0;
 	cmd->client = client;
 	cmd->pDraw = pDraw;
+	cmd->crtc = crtc;
 
-	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT;
-	vbl.request.sequence = target_msc;
-	vbl.request.signal = (unsigned long)cmd;
-	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
-	if (ret) {
-		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+	if (drmmode_crtc_queue_vblank(pScrn, crtc, target_msc, cmd)) {
+		ERROR_MSG("queue vblank event failed: %s", strerror(errno));
+		free(cmd);
 		return FALSE;
 	}
 	DRI2BlockClient(client, pDraw);
@@ -1078,11 +1668,6 @@ ARMSOCDRI2ScreenInit(ScreenPtr pScreen)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	drmVBlank vbl = { .request = {
-		.type = DRM_VBLANK_RELATIVE,
-		.sequence = 0,
-	} };
-	int ret;
 
 	DRI2InfoRec info = {
 #if DRI2INFOREC_VERSION >= 6
@@ -1115,6 +1700,12 @@ ARMSOCDRI2ScreenInit(ScreenPtr pScreen)
 		return FALSE;
 	}
 
+	if (!dixRegisterPrivateKey(&ARMSOCDRI2WindowPrivateKeyRec,
+			PRIVATE_WINDOW, sizeof(struct ARMSOCDRI2WindowRec))) {
+		ERROR_MSG("Failed to register DRI2 window private");
+		return FALSE;
+	}
+
 	/* There is a one-to-one mapping with the DRI2SwapLimit
 	 * feature and the swap chain size. If DRI2SwapLimit is
 	 * not supported swap-chain will be of size 1.
@@ -1146,11 +1737,7 @@ ARMSOCDRI2ScreenInit(ScreenPtr pScreen)
 
 	INFO_MSG("Setting swap chain size: %d ", pARMSOC->swap_chain_size);
 
-	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
-	if (ret)
-		pARMSOC->drmmode_interface->vblank_query_supported = 0;
-	else
-		pARMSOC->drmmode_interface->vblank_query_supported = 1;
+	drmmode_vblank_probe(pScrn);
 
 	return DRI2ScreenInit(pScreen, &info);
 }
@@ -1169,6 +1756,22 @@ ARMSOCDRI2CloseScreen(ScreenPtr pScreen)
 	}
 	DRI2CloseScreen(pScreen);
 
+	if (pARMSOC->driAdaptiveBufs && pARMSOC->driNumBufs > 2)
+		INFO_MSG("Adaptive DRI2 buffering: %u grows, %u shrinks",
+			pARMSOC->adaptive_grows, pARMSOC->adaptive_shrinks);
+
+	if (pARMSOC->mailbox_superseded)
+		INFO_MSG("Mailbox swaps superseded before being flipped: %u",
+			pARMSOC->mailbox_superseded);
+
+	if (pARMSOC->idle_timer) {
+		if (pARMSOC->idle_trims)
+			INFO_MSG("Released back buffers of idle DRI2 drawables %u times",
+				pARMSOC->idle_trims);
+		TimerFree(pARMSOC->idle_timer);
+		pARMSOC->idle_timer = NULL;
+	}
+
 	if (pARMSOC->swap_chain) {
 		unsigned int idx = pARMSOC->swap_chain_count % pARMSOC->swap_chain_size;
 		assert(!pARMSOC->swap_chain[idx]);
@@ -38,6 +38,8 @@
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <pixman.h>
 
@@ -107,6 +109,14 @@ enum {
 	OPTION_BUSID,
 	OPTION_DRIVERNAME,
 	OPTION_DRI_NUM_BUF,
+	OPTION_DRI_ADAPTIVE_BUF,
+	OPTION_DRI_IDLE_TIMEOUT,
+	OPTION_SCANOUT_POOL,
+	OPTION_DRI_MAILBOX,
+	OPTION_ASYNC_FLIP,
+	OPTION_PER_CRTC_SCANOUT,
+	OPTION_ATOMIC,
+	OPTION_SCANOUT_HEADROOM,
 	OPTION_INIT_FROM_FBDEV,
 	OPTION_UMP_LOCK,
 };
@@ -119,6 +129,14 @@ static const OptionInfoRec ARMSOCOptions[] = {
 	{ OPTION_BUSID,      "BusID",      OPTV_STRING,  {0}, FALSE },
 	{ OPTION_DRIVERNAME, "DriverName", OPTV_STRING,  {0}, FALSE },
 	{ OPTION_DRI_NUM_BUF, "DRI2MaxBuffers", OPTV_INTEGER, {-1}, FALSE },
+	{ OPTION_DRI_ADAPTIVE_BUF, "DRI2AdaptiveBuffers", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_DRI_IDLE_TIMEOUT, "DRI2IdleTimeout", OPTV_INTEGER, {0}, FALSE },
+	{ OPTION_SCANOUT_POOL, "ScanoutPoolSize", OPTV_INTEGER, {0}, FALSE },
+	{ OPTION_DRI_MAILBOX, "DRI2Mailbox", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_ASYNC_FLIP, "AsyncFlip", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_PER_CRTC_SCANOUT, "PerCrtcScanout", OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_ATOMIC,     "Atomic",     OPTV_BOOLEAN, {0}, FALSE },
+	{ OPTION_SCANOUT_HEADROOM, "ScanoutHeadroom", OPTV_BOOLEAN, {0}, FALSE },
 	{ OPTION_INIT_FROM_FBDEV, "InitFromFBDev", OPTV_STRING, {0}, FALSE },
 	{ OPTION_UMP_LOCK,   "UMP_LOCK",   OPTV_BOOLEAN, {0}, FALSE },
 	{ -1,                NULL,         OPTV_NONE,    {0}, FALSE }
@@ -343,20 +361,121 @@ ARMSOCCloseDRM(ScrnInfoPtr pScrn)
 	}
 }
 
+/* Most threads the fbdev copy is split across */
+#define ARMSOC_COPY_MAX_THREADS 4
+
+/* Rows [y1, y2) of the copy from the fbdev device to the scanout buffer */
+struct ARMSOCCopyBand {
+	pthread_t thread;
+	unsigned char *src, *dst;
+	pixman_format_code_t src_format, dst_format;
+	uint32_t src_pitch, dst_pitch;
+	int src_x, src_y;
+	int width, y1, y2;
+	Bool ok;
+};
+
+/* Pixman format of a packed RGB layout, or 0 if pixman can't read it */
+static pixman_format_code_t ARMSOCPixmanFormat(int bpp, int a,
+		int r, int r_offset, int g, int g_offset, int b, int b_offset)
+{
+	pixman_format_code_t format;
+
+	if (g_offset == b_offset + b && r_offset == g_offset + g)
+		format = PIXMAN_FORMAT(bpp, PIXMAN_TYPE_ARGB, a, r, g, b);
+	else if (g_offset == r_offset + r && b_offset == g_offset + g)
+		format = PIXMAN_FORMAT(bpp, PIXMAN_TYPE_ABGR, a, r, g, b);
+	else
+		return 0;
+
+	return pixman_format_supported_source(format) ? format : 0;
+}
+
+/* Composite some rows with pixman. The row pointers passed to pixman must
+ * be 32-bit aligned, so with odd strides the rows go one at a time through
+ * aligned bounce buffers. */
+static void *ARMSOCCopyBandThread(void *data)
+{
+	struct ARMSOCCopyBand *band = data;
+	pixman_image_t *src_img = NULL, *dst_img = NULL;
+	Bool src_aligned = !(band->src_pitch % sizeof(uint32_t));
+	Bool dst_aligned = !(band->dst_pitch % sizeof(uint32_t));
+	uint32_t src_row_pitch, dst_row_pitch;
+	uint32_t *src_row = NULL, *dst_row = NULL;
+	int src_cpp = PIXMAN_FORMAT_BPP(band->src_format) / 8;
+	int dst_cpp = PIXMAN_FORMAT_BPP(band->dst_format) / 8;
+	int y;
+
+	if (src_aligned && dst_aligned) {
+		src_img = pixman_image_create_bits(band->src_format,
+				band->src_x + band->width, band->y2 - band->y1,
+				(uint32_t *)(band->src +
+					(band->src_y + band->y1) * band->src_pitch),
+				band->src_pitch);
+		dst_img = pixman_image_create_bits(band->dst_format,
+				band->width, band->y2 - band->y1,
+				(uint32_t *)(band->dst + band->y1 * band->dst_pitch),
+				band->dst_pitch);
+		if (!src_img || !dst_img)
+			goto out;
+
+		pixman_image_composite32(PIXMAN_OP_SRC, src_img, NULL, dst_img,
+				band->src_x, 0, 0, 0, 0, 0,
+				band->width, band->y2 - band->y1);
+		band->ok = TRUE;
+		goto out;
+	}
+
+	src_row_pitch = ((band->src_x + band->width) * src_cpp + 3) & ~3;
+	dst_row_pitch = (band->width * dst_cpp + 3) & ~3;
+	src_row = malloc(src_row_pitch);
+	dst_row = malloc(dst_row_pitch);
+	if (!src_row || !dst_row)
+		goto out;
+
+	src_img = pixman_image_create_bits(band->src_format,
+			band->src_x + band->width, 1, src_row, src_row_pitch);
+	dst_img = pixman_image_create_bits(band->dst_format,
+			band->width, 1, dst_row, dst_row_pitch);
+	if (!src_img || !dst_img)
+		goto out;
+
+	for (y = band->y1; y < band->y2; y++) {
+		memcpy(src_row, band->src + (band->src_y + y) * band->src_pitch,
+				(band->src_x + band->width) * src_cpp);
+		pixman_image_composite32(PIXMAN_OP_SRC, src_img, NULL, dst_img,
+				band->src_x, 0, 0, 0, 0, 0, band->width, 1);
+		memcpy(band->dst + y * band->dst_pitch, dst_row,
+				band->width * dst_cpp);
+	}
+	band->ok = TRUE;
+
+out:
+	if (src_img)
+		pixman_image_unref(src_img);
+	if (dst_img)
+		pixman_image_unref(dst_img);
+	free(src_row);
+	free(dst_row);
+	return NULL;
+}
+
 static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 {
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	int src_cpp;
+	struct ARMSOCCopyBand bands[ARMSOC_COPY_MAX_THREADS];
+	pixman_format_code_t src_format, dst_format;
 	uint32_t src_pitch;
-	int src_pixman_stride;
-	int dst_pixman_stride;
-	int dst_width, dst_height, dst_bpp, dst_pitch;
+	int dst_width, dst_height, dst_bpp, dst_pitch, dst_cpp;
 	unsigned int src_size = 0;
 	unsigned char *src = NULL, *dst = NULL;
 	struct fb_var_screeninfo vinfo;
+	struct fb_fix_screeninfo finfo;
 	int fd = -1;
 	int width, height;
-	pixman_bool_t pixman_ret;
+	int i, y, num_bands, num_threads = 0;
+	long cpus;
+	sigset_t sigmask, old_sigmask;
 	Bool ret = FALSE;
 
 	dst = armsoc_bo_map(pARMSOC->scanout);
@@ -365,7 +484,9 @@ static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 		goto exit;
 	}
 
-	fd = open(fb_dev, O_RDONLY | O_SYNC);
+	/* Nothing else draws to the console while we read it, so there is
+	 * no need for an uncached (O_SYNC) mapping */
+	fd = open(fb_dev, O_RDONLY);
 	if (fd == -1) {
 		ERROR_MSG("Couldn't open %s", fb_dev);
 		goto exit;
@@ -376,12 +497,19 @@ static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 		goto exit;
 	}
 
-	src_cpp = (vinfo.bits_per_pixel + 7) / 8;
-	src_pitch = vinfo.xres_virtual * src_cpp;
+	if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) < 0) {
+		ERROR_MSG("Fscreeninfo ioctl failed");
+		goto exit;
+	}
+
+	src_pitch = finfo.line_length;
+	if (!src_pitch)
+		src_pitch = vinfo.xres_virtual * ((vinfo.bits_per_pixel + 7) / 8);
 	src_size = vinfo.yres_virtual * src_pitch;
 
 	src = mmap(NULL, src_size, PROT_READ, MAP_SHARED, fd, 0);
 	if (src == MAP_FAILED) {
+		src = NULL;
 		ERROR_MSG("Couldn't mmap %s", fb_dev);
 		goto exit;
 	}
@@ -390,83 +518,98 @@ static Bool ARMSOCCopyFB(ScrnInfoPtr pScrn, const char *fb_dev)
 	dst_height = armsoc_bo_height(pARMSOC->scanout);
 	dst_bpp = armsoc_bo_bpp(pARMSOC->scanout);
 	dst_pitch = armsoc_bo_pitch(pARMSOC->scanout);
+	dst_cpp = dst_bpp / 8;
 
 	width = min(vinfo.xres, dst_width);
 	height = min(vinfo.yres, dst_height);
 
-	/* The stride parameters pixman takes are in multiples of uint32_t,
-	 * which is the data type of the pointer passed */
-	src_pixman_stride = src_pitch/sizeof(uint32_t);
-	dst_pixman_stride = dst_pitch/sizeof(uint32_t);
-
-	/* We could handle the cases where stride is not a multiple of uint32_t,
-	 * but they will be rare so not currently worth the added complexity */
-	if (src_pitch%sizeof(uint32_t) || dst_pitch%sizeof(uint32_t)) {
-		ERROR_MSG(
-				"Buffer strides need to be a multiple of 4 bytes to initialize from fbdev device");
-		goto exit;
-	}
-
-	/* similarly using pixman_blt doesn't allow for format conversion, so
-	 * check if they don't match and print a message */
-	if (vinfo.bits_per_pixel != dst_bpp || vinfo.grayscale != 0 ||
-			vinfo.nonstd != 0 ||
-			vinfo.red.offset != pScrn->offset.red ||
-			vinfo.red.length != pScrn->weight.red ||
-			vinfo.red.msb_right != 0 ||
-			vinfo.green.offset != pScrn->offset.green ||
-			vinfo.green.length != pScrn->weight.green ||
-			vinfo.green.msb_right != 0 ||
-			vinfo.blue.offset != pScrn->offset.blue ||
-			vinfo.blue.length != pScrn->weight.blue ||
-			vinfo.blue.msb_right != 0) {
-		ERROR_MSG("Format of %s does not match scanout buffer", fb_dev);
+	/* pixman converts between the fbdev and the screen formats */
+	src_format = 0;
+	if (vinfo.grayscale == 0 && vinfo.nonstd == 0 &&
+			!vinfo.red.msb_right && !vinfo.green.msb_right &&
+			!vinfo.blue.msb_right)
+		src_format = ARMSOCPixmanFormat(vinfo.bits_per_pixel,
+				vinfo.transp.length,
+				vinfo.red.length, vinfo.red.offset,
+				vinfo.green.length, vinfo.green.offset,
+				vinfo.blue.length, vinfo.blue.offset);
+	dst_format = ARMSOCPixmanFormat(dst_bpp, 0,
+			pScrn->weight.red, pScrn->offset.red,
+			pScrn->weight.green, pScrn->offset.green,
+			pScrn->weight.blue, pScrn->offset.blue);
+	if (!src_format || !dst_format) {
+		ERROR_MSG("Can't convert from the format of %s to the scanout buffer",
+				fb_dev);
 		goto exit;
 	}
 
-	armsoc_bo_cpu_prep(pARMSOC->scanout, ARMSOC_GEM_WRITE);
-
 	/* NB: We have to call pixman direct instead of wrapping the buffers as
 	 * Pixmaps as this function is called from ScreenInit. Pixmaps cannot be
 	 * created until X calls CreateScratchPixmapsForScreen(), and the screen
 	 * pixmap is not initialized until X calls CreateScreenResources */
-	pixman_ret = pixman_blt((uint32_t *)src, (uint32_t *)dst,
-			src_pixman_stride, dst_pixman_stride,
-			vinfo.bits_per_pixel, dst_bpp, vinfo.xoffset,
-			vinfo.yoffset, 0, 0, width, height);
-	if (!pixman_ret) {
-		armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
-		ERROR_MSG("Pixman failed to blit from %s to scanout buffer",
-				fb_dev);
-		goto exit;
+
+	/* Split the copy into bands of rows, one per CPU up to a limit.
+	 * Converting between formats keeps a CPU busy, so that part scales
+	 * with the CPUs; a plain copy limited by the read bandwidth of the
+	 * framebuffer gains less. */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	num_bands = min(max(cpus, 1), ARMSOC_COPY_MAX_THREADS);
+	num_bands = min(num_bands, max(height, 1));
+
+	armsoc_bo_cpu_prep(pARMSOC->scanout, ARMSOC_GEM_WRITE);
+
+	for (i = 0; i < num_bands; i++) {
+		bands[i].src = src;
+		bands[i].dst = dst;
+		bands[i].src_format = src_format;
+		bands[i].dst_format = dst_format;
+		bands[i].src_pitch = src_pitch;
+		bands[i].dst_pitch = dst_pitch;
+		bands[i].src_x = vinfo.xoffset;
+		bands[i].src_y = vinfo.yoffset;
+		bands[i].width = width;
+		bands[i].y1 = height * i / num_bands;
+		bands[i].y2 = height * (i + 1) / num_bands;
+		bands[i].ok = FALSE;
 	}
 
-	/* fill any area not covered by the blit */
-	if (width < dst_width) {
-		pixman_ret = pixman_fill((uint32_t *)dst, dst_pixman_stride,
-				dst_bpp, width, 0, dst_width-width, dst_height,
-				0);
-		if (!pixman_ret) {
-			armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
-			ERROR_MSG(
-					"Pixman failed to fill margin of scanout buffer");
+	/* The first band is done on this thread. The others run with all
+	 * signals blocked, like the server's own threads, so that signals
+	 * such as SIGIO and SIGALRM still go to the main thread. */
+	sigfillset(&sigmask);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &old_sigmask);
+	for (i = 1; i < num_bands; i++) {
+		if (pthread_create(&bands[i].thread, NULL,
+				ARMSOCCopyBandThread, &bands[i]))
+			break;
+		num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_sigmask, NULL);
+	for (i = num_threads + 1; i < num_bands; i++)
+		ARMSOCCopyBandThread(&bands[i]);
+	ARMSOCCopyBandThread(&bands[0]);
+	for (i = 1; i <= num_threads; i++)
+		pthread_join(bands[i].thread, NULL);
+
+	for (i = 0; i < num_bands; i++) {
+		if (!bands[i].ok) {
+			armsoc_bo_cpu_fini(pARMSOC->scanout, ARMSOC_GEM_WRITE);
+			ERROR_MSG("Pixman failed to copy from %s to scanout buffer",
+					fb_dev);
 			goto exit;
 		}
 	}
 
-	if (height < dst_height) {
-		pixman_ret = pixman_fill((uint32_t *)dst, dst_pixman_stride,
-				dst_bpp, 0, height, width, dst_height-height,
-				0);
-		if (!pixman_ret) {
-			armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
-			ERROR_MSG(
-					"Pixman failed to fill margin of scanout buffer");
-			goto exit;
-		}
+	/* clear any area not covered by the copy */
+	for (y = 0; y < dst_height; y++) {
+		if (y < height)
+			memset(dst + y * dst_pitch + width * dst_cpp, 0,
+					(dst_width - width) * dst_cpp);
+		else
+			memset(dst + y * dst_pitch, 0, dst_width * dst_cpp);
 	}
 
-	armsoc_bo_cpu_fini(pARMSOC->scanout, 0);
+	armsoc_bo_cpu_fini(pARMSOC->scanout, ARMSOC_GEM_WRITE);
 
 	ret = TRUE;
 
@@ -737,6 +880,8 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 	rgb defaultMask = { 0, 0, 0 };
 	Gamma defaultGamma = { 0.0, 0.0, 0.0 };
 	int driNumBufs;
+	int driIdleTimeout;
+	int scanoutPoolSize;
 
 	TRACE_ENTER();
 
@@ -813,7 +958,8 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 
 	/* create DRM device instance: */
 	pARMSOC->dev = armsoc_device_new(pARMSOC->drmFD,
-			pARMSOC->drmmode_interface->create_custom_gem);
+			pARMSOC->drmmode_interface->create_custom_gem,
+			pARMSOC->drmmode_interface->zeroed_allocations);
 
 	/* set chipset name: */
 	pScrn->chipset = (char *)ARMSOC_CHIPSET_NAME;
@@ -851,11 +997,99 @@ ARMSOCPreInit(ScrnInfoPtr pScrn, int flags)
 		return FALSE;
 	}
 	pARMSOC->driNumBufs = driNumBufs;
+	/* Determine if the number of buffers should adapt to the client: */
+	pARMSOC->driAdaptiveBufs = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_DRI_ADAPTIVE_BUF, TRUE);
+	if (driNumBufs > 2)
+		INFO_MSG("Adaptive DRI2 buffering is %s",
+				pARMSOC->driAdaptiveBufs ? "Enabled" : "Disabled");
+
+	if (!xf86GetOptValInteger(pARMSOC->pOptionInfo, OPTION_DRI_IDLE_TIMEOUT,
+			&driIdleTimeout)) {
+		driIdleTimeout = 10;
+	}
+
+	if (driIdleTimeout < 0) {
+		ERROR_MSG(
+			"Invalid option for %s: %d. Must be greater than or equal to 0",
+			xf86TokenToOptName(pARMSOC->pOptionInfo,
+				OPTION_DRI_IDLE_TIMEOUT),
+			driIdleTimeout);
+		return FALSE;
+	}
+	pARMSOC->driIdleTimeout = driIdleTimeout;
+
+	/* Determine if newer swaps should replace ones not yet flipped: */
+	pARMSOC->driMailbox = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_DRI_MAILBOX, FALSE);
+	if (pARMSOC->driMailbox) {
+		/* A parked swap is only replaced when a third one arrives
+		 * while it waits behind a pending flip, which needs a swap
+		 * limit of 3 or more */
+		int limit = driNumBufs - 1;
+
+		if (pARMSOC->drmmode_interface->use_early_display)
+			limit++;
+
+		if (limit < 3) {
+			WARNING_MSG(
+				"%s needs a larger %s to have any effect, disabling it",
+				xf86TokenToOptName(pARMSOC->pOptionInfo,
+					OPTION_DRI_MAILBOX),
+				xf86TokenToOptName(pARMSOC->pOptionInfo,
+					OPTION_DRI_NUM_BUF));
+			pARMSOC->driMailbox = FALSE;
+		} else if (pARMSOC->driAdaptiveBufs) {
+			/* Adaptive buffering starts windows with a lower
+			 * swap limit than the mailbox needs */
+			INFO_MSG("%s disables adaptive DRI2 buffering",
+				xf86TokenToOptName(pARMSOC->pOptionInfo,
+					OPTION_DRI_MAILBOX));
+			pARMSOC->driAdaptiveBufs = FALSE;
+		}
+	}
+	/* Determine if each CRTC should scan out a buffer of its own: */
+	pARMSOC->PerCrtcScanout = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_PER_CRTC_SCANOUT, FALSE);
 	/* Determine if user wants to disable buffer flipping: */
 	pARMSOC->NoFlip = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
 			OPTION_NO_FLIP, FALSE);
+	if (pARMSOC->PerCrtcScanout && !pARMSOC->NoFlip) {
+		/* The root pixmap isn't scanned out, so there is nothing
+		 * for fullscreen windows to flip with */
+		INFO_MSG("%s disables buffer flipping",
+			xf86TokenToOptName(pARMSOC->pOptionInfo,
+				OPTION_PER_CRTC_SCANOUT));
+		pARMSOC->NoFlip = TRUE;
+	}
 	INFO_MSG("Buffer Flipping is %s",
 				pARMSOC->NoFlip ? "Disabled" : "Enabled");
+
+	if (!xf86GetOptValInteger(pARMSOC->pOptionInfo, OPTION_SCANOUT_POOL,
+			&scanoutPoolSize)) {
+		/* Off by default: the pool holds screen-sized buffers
+		 * whether or not a client ever flips */
+		scanoutPoolSize = 0;
+	}
+
+	if (scanoutPoolSize < 0) {
+		ERROR_MSG(
+			"Invalid option for %s: %d. Must be greater than or equal to 0",
+			xf86TokenToOptName(pARMSOC->pOptionInfo,
+				OPTION_SCANOUT_POOL),
+			scanoutPoolSize);
+		return FALSE;
+	}
+	pARMSOC->scanout_pool_size = scanoutPoolSize;
+	/* Determine if late swaps may flip without waiting for vblank: */
+	pARMSOC->AsyncFlip = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_ASYNC_FLIP, FALSE);
+	/* Determine if displays should be programmed with atomic commits: */
+	pARMSOC->Atomic = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_ATOMIC, FALSE);
+	/* Determine if the scanout should be allocated for the largest mode: */
+	pARMSOC->ScanoutHeadroom = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
+			OPTION_SCANOUT_HEADROOM, FALSE);
 	pARMSOC->useUmplock = xf86ReturnOptValBool(pARMSOC->pOptionInfo,
 			OPTION_UMP_LOCK, FALSE);
 	INFO_MSG("umplock is %s",
@@ -978,9 +1212,32 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 			depth, pScrn->bitsPerPixel);
 	assert(!pARMSOC->scanout);
 	/* Screen creates and takes a ref on the scanout bo */
-	pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev, pScrn->virtualX,
-			pScrn->virtualY, depth, pScrn->bitsPerPixel,
-			ARMSOC_BO_SCANOUT);
+	if (pARMSOC->ScanoutHeadroom) {
+		int width, height;
+
+		/* Make room for the largest mode, so that RandR changes
+		 * resize the buffer in place */
+		drmmode_scanout_capacity(pScrn, &width, &height);
+		DEBUG_MSG("reserving scanout buffer of %dx%d", width, height);
+		pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
+				width, height, depth, pScrn->bitsPerPixel,
+				pARMSOC->PerCrtcScanout ?
+					ARMSOC_BO_NON_SCANOUT :
+					ARMSOC_BO_SCANOUT);
+		if (pARMSOC->scanout &&
+		    armsoc_bo_resize(pARMSOC->scanout, pScrn->virtualX,
+				pScrn->virtualY)) {
+			armsoc_bo_unreference(pARMSOC->scanout);
+			pARMSOC->scanout = NULL;
+		}
+	}
+	if (!pARMSOC->scanout)
+		pARMSOC->scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
+				pScrn->virtualX, pScrn->virtualY,
+				depth, pScrn->bitsPerPixel,
+				pARMSOC->PerCrtcScanout ?
+					ARMSOC_BO_NON_SCANOUT :
+					ARMSOC_BO_SCANOUT);
 	if (!pARMSOC->scanout) {
 		ERROR_MSG("Cannot allocate scanout buffer\n");
 		goto fail1;
@@ -1072,7 +1329,10 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 	fbdev = xf86GetOptValString(pARMSOC->pOptionInfo,
 			OPTION_INIT_FROM_FBDEV);
 	if (fbdev && *fbdev != '\0') {
-		if (ARMSOCCopyFB(pScrn, fbdev)) {
+		/* Prefer the framebuffers KMS is scanning out, which need
+		 * no uncached reads through the fbdev device */
+		if (drmmode_copy_boot_fb(pScrn) ||
+				ARMSOCCopyFB(pScrn, fbdev)) {
 			/* Only allow None BG root if we initialized the scanout
 			 * buffer */
 			pScreen->canDoBGNoneRoot = TRUE;
@@ -1131,6 +1391,24 @@ ARMSOCScreenInit(SCREEN_INIT_ARGS_DECL)
 	wrap(pARMSOC, pScreen, BlockHandler, ARMSOCBlockHandler);
 	drmmode_screen_init(pScrn);
 
+	/* Pre-allocate flippable buffers so that the first frames of
+	 * fullscreen DRI2 clients don't have to wait for them */
+	if (pARMSOC->dri && pARMSOC->scanout_pool_size > 0) {
+		pARMSOC->scanout_pool = calloc(pARMSOC->scanout_pool_size,
+				sizeof(*pARMSOC->scanout_pool));
+		pARMSOC->scanout_pool_out = calloc(pARMSOC->scanout_pool_size,
+				sizeof(*pARMSOC->scanout_pool_out));
+		if (pARMSOC->scanout_pool && pARMSOC->scanout_pool_out) {
+			armsoc_scanout_pool_fill(pScrn);
+		} else {
+			free(pARMSOC->scanout_pool);
+			free(pARMSOC->scanout_pool_out);
+			pARMSOC->scanout_pool = NULL;
+			pARMSOC->scanout_pool_out = NULL;
+			pARMSOC->scanout_pool_size = 0;
+		}
+	}
+
 	if (pARMSOC->useUmplock) {
 		pARMSOC->lockFD = open("/dev/umplock", O_RDWR);
 
@@ -1228,6 +1506,8 @@ ARMSOCCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 		(void) (*pScreen->DestroyPixmap)(pScreen->devPrivate);
 		pScreen->devPrivate = NULL;
 	}
+	/* destroyed along with the root pixmap */
+	pARMSOC->scanout_damage = NULL;
 
 	unwrap(pARMSOC, pScreen, CloseScreen);
 	unwrap(pARMSOC, pScreen, BlockHandler);
@@ -1242,6 +1522,14 @@ ARMSOCCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 		if (pARMSOC->pARMSOCEXA->CloseScreen)
 			pARMSOC->pARMSOCEXA->CloseScreen(CLOSE_SCREEN_ARGS);
 
+	if (pARMSOC->scanout_pool) {
+		armsoc_scanout_pool_flush(pScrn);
+		free(pARMSOC->scanout_pool);
+		free(pARMSOC->scanout_pool_out);
+		pARMSOC->scanout_pool = NULL;
+		pARMSOC->scanout_pool_out = NULL;
+	}
+
 	assert(pARMSOC->scanout);
 	/* Screen drops its ref on the scanout buffer */
 	armsoc_bo_unreference(pARMSOC->scanout);
@@ -1281,6 +1569,19 @@ ARMSOCCreateScreenResources(ScreenPtr pScreen)
 		return FALSE;
 	swap(pARMSOC, pScreen, CreateScreenResources);
 
+	if (pARMSOC->PerCrtcScanout) {
+		PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+
+		/* Track what needs copying to the CRTCs' scanout buffers */
+		pARMSOC->scanout_damage = DamageCreate(NULL, NULL,
+				DamageReportNone, TRUE, pScreen, NULL);
+		if (!pARMSOC->scanout_damage) {
+			ERROR_MSG("Cannot create damage for per-CRTC scanout");
+			return FALSE;
+		}
+		DamageRegister(&rootPixmap->drawable, pARMSOC->scanout_damage);
+	}
+
 	return TRUE;
 }
 
@@ -1295,6 +1596,14 @@ ARMSOCBlockHandler(BLOCKHANDLER_ARGS_DECL)
 	swap(pARMSOC, pScreen, BlockHandler);
 	(*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
 	swap(pARMSOC, pScreen, BlockHandler);
+
+	/* Take back scanout pool buffers that are no longer used, and
+	 * replace ones dropped because of a mode change, while nothing
+	 * else is going on */
+	if (pARMSOC->scanout_pool_count < pARMSOC->scanout_pool_size)
+		armsoc_scanout_pool_fill(pScrn);
+	if (pARMSOC->scanout_damage)
+		drmmode_update_crtc_scanouts(pScrn);
 }
 
 
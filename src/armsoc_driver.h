@@ -36,6 +36,7 @@
 #include "xf86RAC.h"
 #endif
 #include "xf86drm.h"
+#include "damage.h"
 #include <errno.h>
 #include "armsoc_exa.h"
 
@@ -134,6 +135,13 @@ struct ARMSOCRec {
 	/** user-configurable option: */
 	Bool				NoFlip;
 	unsigned			driNumBufs;
+	Bool				driAdaptiveBufs;
+	unsigned			driIdleTimeout;
+	Bool				driMailbox;
+	Bool				AsyncFlip;
+	Bool				PerCrtcScanout;
+	Bool				Atomic;
+	Bool				ScanoutHeadroom;
 
 	/** File descriptor of the connection with the DRM. */
 	int					drmFD;
@@ -163,6 +171,10 @@ struct ARMSOCRec {
 	/** Flips we are waiting for: */
 	int					pending_flips;
 
+	/** Bumped on every modeset or DPMS change, so that per-drawable
+	 * CRTC lookups know when to refresh */
+	unsigned int		crtc_config_serial;
+
 	/* Identify which CRTC to use. -1 uses all CRTCs */
 	int					crtcNum;
 
@@ -180,6 +192,38 @@ struct ARMSOCRec {
 	/* Size of the swap chain. Set to 1 if DRI2SwapLimit unsupported,
 	 * driNumBufs if early display enabled, otherwise driNumBufs-1 */
 	unsigned int                       swap_chain_size;
+
+	/* Number of times adaptive buffering added or released a back
+	 * buffer, across all drawables */
+	unsigned int                       adaptive_grows;
+	unsigned int                       adaptive_shrinks;
+
+	/* Swap waiting for the pending flips to complete in mailbox mode,
+	 * and how many swaps were replaced by a newer one while waiting */
+	struct ARMSOCDRISwapCmd            *mailbox;
+	unsigned int                       mailbox_superseded;
+
+	/* Back buffers of n-buffered drawables, and the timer that releases
+	 * the extra pixmaps of those that stopped swapping */
+	struct ARMSOCDRI2BufferRec         *idle_buffers;
+	OsTimerPtr                         idle_timer;
+	unsigned int                       idle_trims;
+
+	/* Pool of screen-sized scanout bos with fbs attached, handed out to
+	 * flippable DRI2 buffers. scanout_pool has scanout_pool_size slots,
+	 * of which the first scanout_pool_count are filled */
+	struct armsoc_bo                   **scanout_pool;
+	int                                scanout_pool_size;
+	int                                scanout_pool_count;
+	/* The bos handed out, which the pool keeps a ref on to see when
+	 * they are given back; also scanout_pool_size slots */
+	struct armsoc_bo                   **scanout_pool_out;
+	/* After a failed allocation, when to try filling the pool again */
+	CARD32                             scanout_pool_retry;
+
+	/* With PerCrtcScanout, what has been drawn to the root pixmap since
+	 * the CRTCs' own scanout buffers were last updated */
+	DamagePtr                          scanout_damage;
 };
 
 /*
@@ -223,23 +267,52 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp);
 void drmmode_screen_init(ScrnInfoPtr pScrn);
 void drmmode_screen_fini(ScrnInfoPtr pScrn);
 void drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y);
-Bool drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv);
+int drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv,
+		Bool *async);
 void drmmode_wait_for_event(ScrnInfoPtr pScrn);
+xf86CrtcPtr drmmode_covering_crtc(ScrnInfoPtr pScrn, BoxPtr box);
+void drmmode_update_crtc_scanouts(ScrnInfoPtr pScrn);
+Bool drmmode_copy_boot_fb(ScrnInfoPtr pScrn);
+void drmmode_scanout_capacity(ScrnInfoPtr pScrn, int *width, int *height);
+uint32_t drmmode_crtc_vblank_pipe(xf86CrtcPtr crtc);
+xf86CrtcPtr drmmode_crtc_from_id(ScrnInfoPtr pScrn, uint32_t crtc_id);
+void drmmode_crtc_note_vblank(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t msc, uint64_t ust);
+Bool drmmode_crtc_get_msc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t *ust, uint64_t *msc);
+uint64_t drmmode_crtc_widen_msc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint32_t sequence);
+int drmmode_crtc_queue_vblank(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t target_msc, void *data);
+void drmmode_vblank_probe(ScrnInfoPtr pScrn);
 Bool drmmode_cursor_init(ScreenPtr pScreen);
 void drmmode_cursor_fini(ScreenPtr pScreen);
 void drmmode_init_wakeup_handler(struct ARMSOCRec *pARMSOC);
 void drmmode_fini_wakeup_handler(struct ARMSOCRec *pARMSOC);
 
 
+/**
+ * Scanout bo pool functions..
+ */
+struct armsoc_bo *armsoc_scanout_pool_get(ScrnInfoPtr pScrn, int width,
+		int height, int depth, int bpp);
+void armsoc_scanout_pool_fill(ScrnInfoPtr pScrn);
+void armsoc_scanout_pool_flush(ScrnInfoPtr pScrn);
+
+
 /**
  * DRI2 functions..
  */
 struct ARMSOCDRISwapCmd;
+struct ARMSOCDRI2BufferRec;
 Bool ARMSOCDRI2ScreenInit(ScreenPtr pScreen);
 void ARMSOCDRI2CloseScreen(ScreenPtr pScreen);
 void ARMSOCDRI2SwapComplete(struct ARMSOCDRISwapCmd *cmd);
 void ARMSOCDRI2ResizeSwapChain(ScrnInfoPtr pScrn, struct armsoc_bo *old_bo, struct armsoc_bo *resized_bo);
-void ARMSOCDRI2VBlankHandler(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data);
+void ARMSOCDRI2FlipHandler(unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *user_data);
+void ARMSOCDRI2VBlankHandler(uint64_t msc, uint64_t ust, Bool legacy,
+		void *user_data);
 
 /**
  * DRI2 util functions..
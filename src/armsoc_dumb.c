@@ -46,7 +46,8 @@ struct armsoc_device {
 	int fd;
 	int (*create_custom_gem)(int fd, struct armsoc_create_gem *create_gem);
 	Bool alpha_supported;
-
+	/* new GEM objects come back zero-filled from the kernel */
+	Bool zeroed_allocations;
 };
 
 struct armsoc_bo {
@@ -67,6 +68,11 @@ struct armsoc_bo {
 	 */
 	uint32_t original_size;
 	uint32_t name;
+	/* memory still holds the zeros the kernel allocated it with */
+	Bool zeroed;
+	/* a name or dmabuf fd was handed out, so other processes may still
+	 * hold on to the memory */
+	Bool exported;
 };
 
 /* device related functions:
@@ -74,7 +80,8 @@ struct armsoc_bo {
 
 struct armsoc_device *armsoc_device_new(int fd,
 			int (*create_custom_gem)(int fd,
-				struct armsoc_create_gem *create_gem))
+				struct armsoc_create_gem *create_gem),
+			int zeroed_allocations)
 {
 	struct armsoc_device *new_dev = calloc(1, sizeof(*new_dev));
 	if (!new_dev)
@@ -83,6 +90,7 @@ struct armsoc_device *armsoc_device_new(int fd,
 	new_dev->fd = fd;
 	new_dev->create_custom_gem = create_custom_gem;
 	new_dev->alpha_supported = TRUE;
+	new_dev->zeroed_allocations = zeroed_allocations;
 	return new_dev;
 }
 
@@ -102,6 +110,10 @@ int armsoc_bo_set_dmabuf(struct armsoc_bo *bo)
 	assert(bo->refcnt > 0);
 	assert(!armsoc_bo_has_dmabuf(bo));
 
+	/* the importer may write to it */
+	bo->zeroed = FALSE;
+	bo->exported = TRUE;
+
 	/* Try to get dma_buf fd */
 	prime_handle.handle = bo->handle;
 	prime_handle.flags  = 0;
@@ -170,6 +182,7 @@ struct armsoc_bo *armsoc_bo_new_with_dim(struct armsoc_device *dev,
 	new_buf->refcnt = 1;
 	new_buf->dmabuf = -1;
 	new_buf->name = 0;
+	new_buf->zeroed = dev->zeroed_allocations;
 
 	return new_buf;
 }
@@ -223,8 +236,24 @@ void armsoc_bo_reference(struct armsoc_bo *bo)
 	bo->refcnt++;
 }
 
+int armsoc_bo_refcount(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	return bo->refcnt;
+}
+
+int armsoc_bo_exported(struct armsoc_bo *bo)
+{
+	assert(bo->refcnt > 0);
+	return bo->exported;
+}
+
 int armsoc_bo_get_name(struct armsoc_bo *bo, uint32_t *name)
 {
+	/* whoever opens the name may write to it */
+	bo->zeroed = FALSE;
+	bo->exported = TRUE;
+
 	if (bo->name == 0) {
 		int ret;
 		struct drm_gem_flink flink;
@@ -293,6 +322,8 @@ uint32_t armsoc_bo_pitch(struct armsoc_bo *bo)
 void *armsoc_bo_map(struct armsoc_bo *bo)
 {
 	assert(bo->refcnt > 0);
+	/* whoever maps the bo may write to it */
+	bo->zeroed = FALSE;
 	if (!bo->map_addr) {
 		struct drm_mode_map_dumb map_dumb;
 		int res;
@@ -398,17 +429,93 @@ int armsoc_bo_rm_fb(struct armsoc_bo *bo)
 	return 0;
 }
 
+/* Detach the framebuffer from a bo without removing it, so that a new one
+ * can be added while the old one is still scanned out. Returns its id; the
+ * caller must drmModeRmFB() it. */
+uint32_t armsoc_bo_release_fb(struct armsoc_bo *bo)
+{
+	uint32_t fb_id = bo->fb_id;
+
+	assert(bo->refcnt > 0);
+	bo->fb_id = 0;
+	return fb_id;
+}
+
+/* Undo armsoc_bo_release_fb() and a resize after it: put back the
+ * dimensions and the framebuffer the bo had, which is still scanned out */
+void armsoc_bo_restore_fb(struct armsoc_bo *bo, uint32_t width,
+		uint32_t height, uint32_t pitch, uint32_t size, uint32_t fb_id)
+{
+	assert(bo->refcnt > 0);
+	assert(bo->fb_id == 0);
+	bo->width  = width;
+	bo->height = height;
+	bo->pitch  = pitch;
+	bo->size   = size;
+	bo->fb_id  = fb_id;
+}
+
 uint32_t armsoc_bo_get_fb(struct armsoc_bo *bo)
 {
 	assert(bo->refcnt > 0);
 	return bo->fb_id;
 }
 
+/* Zero memory with non-temporal stores on AArch64, which has them (STNP).
+ * Scanout buffers are usually uncached or write-combined, where these are
+ * much faster than memset()'s stores, and on cached memory they avoid
+ * evicting everything else for data nobody will read soon. Elsewhere this
+ * is memset().
+ */
+void armsoc_zero_stream(void *dst, size_t len)
+{
+	unsigned char *p = dst;
+	size_t head = (64 - ((uintptr_t)p & 63)) & 63;
+	size_t body;
+
+	if (len < 128) {
+		memset(p, 0, len);
+		return;
+	}
+
+	memset(p, 0, head);
+	p += head;
+	len -= head;
+	body = len & ~(size_t)63;
+
+#if defined(__aarch64__)
+	{
+		unsigned char *end = p + body;
+
+		__asm__ volatile (
+			"movi	v0.16b, #0\n"
+			"1:\n"
+			"stnp	q0, q0, [%0]\n"
+			"stnp	q0, q0, [%0, #32]\n"
+			"add	%0, %0, #64\n"
+			"cmp	%0, %1\n"
+			"b.lo	1b\n"
+			: "+r" (p)
+			: "r" (end)
+			: "v0", "memory", "cc");
+	}
+#else
+	memset(p, 0, body);
+	p += body;
+#endif
+
+	memset(p, 0, len - body);
+}
+
 int armsoc_bo_clear(struct armsoc_bo *bo)
 {
 	unsigned char *dst;
 
 	assert(bo->refcnt > 0);
+	/* nothing to do for memory fresh from the kernel */
+	if (bo->zeroed)
+		return 0;
+
 	dst = armsoc_bo_map(bo);
 	if (!dst) {
 		xf86DrvMsg(-1, X_ERROR,
@@ -421,11 +528,46 @@ int armsoc_bo_clear(struct armsoc_bo *bo)
 			__func__);
 		return -1;
 	}
-	memset(dst, 0x0, bo->size);
+	armsoc_zero_stream(dst, bo->size);
 	(void)armsoc_bo_cpu_fini(bo, ARMSOC_GEM_WRITE);
 	return 0;
 }
 
+/* Work out the pitch and size of a bo resized to new_width x new_height.
+ * The pitch is kept if the new width fits in it, so that what the bo
+ * holds stays in place. Returns FALSE if the bo's memory is too small.
+ */
+static Bool armsoc_bo_resized_dims(struct armsoc_bo *bo, uint32_t new_width,
+		uint32_t new_height, uint32_t *new_pitch, uint32_t *new_size)
+{
+	uint32_t cpp = (armsoc_bo_bpp(bo)+7)/8;
+
+	if (new_width * cpp <= bo->pitch) {
+		*new_pitch = bo->pitch;
+	} else {
+		/* TODO: MIDEGL-1563: Get pitch from DRM as
+		 * only DRM knows the ideal pitch and alignment
+		 * requirements
+		 * */
+		*new_pitch = new_width * cpp;
+		/* Align pitch to 64 byte */
+		*new_pitch = ALIGN(*new_pitch, 64);
+	}
+	*new_size = ((new_height-1) * *new_pitch) + (new_width * cpp);
+
+	return *new_size <= bo->original_size;
+}
+
+int armsoc_bo_can_resize(struct armsoc_bo *bo, uint32_t new_width,
+						uint32_t new_height)
+{
+	uint32_t new_pitch, new_size;
+
+	assert(bo->refcnt > 0);
+	return armsoc_bo_resized_dims(bo, new_width, new_height,
+			&new_pitch, &new_size);
+}
+
 int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 						uint32_t new_height)
 {
@@ -444,17 +586,8 @@ int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 	xf86DrvMsg(-1, X_INFO, "Resizing bo from %dx%d to %dx%d\n",
 			bo->width, bo->height, new_width, new_height);
 
-	/* TODO: MIDEGL-1563: Get pitch from DRM as
-	 * only DRM knows the ideal pitch and alignment
-	 * requirements
-	 * */
-	new_pitch  = new_width * ((armsoc_bo_bpp(bo)+7)/8);
-	/* Align pitch to 64 byte */
-	new_pitch  = ALIGN(new_pitch, 64);
-	new_size   = (((new_height-1) * new_pitch) +
-			(new_width * ((armsoc_bo_bpp(bo)+7)/8)));
-
-	if (new_size <= bo->original_size) {
+	if (armsoc_bo_resized_dims(bo, new_width, new_height,
+			&new_pitch, &new_size)) {
 		bo->width  = new_width;
 		bo->height = new_height;
 		bo->pitch  = new_pitch;
@@ -57,7 +57,8 @@ struct armsoc_create_gem {
 };
 
 struct armsoc_device *armsoc_device_new(int fd,
-	int (*create_custom_gem)(int fd, struct armsoc_create_gem *create_gem));
+	int (*create_custom_gem)(int fd, struct armsoc_create_gem *create_gem),
+	int zeroed_allocations);
 void armsoc_device_del(struct armsoc_device *dev);
 int armsoc_bo_get_name(struct armsoc_bo *bo, uint32_t *name);
 uint32_t armsoc_bo_handle(struct armsoc_bo *bo);
@@ -82,6 +83,8 @@ uint32_t armsoc_bo_pitch(struct armsoc_bo *bo);
 
 void armsoc_bo_reference(struct armsoc_bo *bo);
 void armsoc_bo_unreference(struct armsoc_bo *bo);
+int armsoc_bo_refcount(struct armsoc_bo *bo);
+int armsoc_bo_exported(struct armsoc_bo *bo);
 
 /* When dmabuf is set on a bo, armsoc_bo_cpu_prep()
  *  waits for KDS shared access
@@ -90,7 +93,14 @@ int armsoc_bo_set_dmabuf(struct armsoc_bo *bo);
 void armsoc_bo_clear_dmabuf(struct armsoc_bo *bo);
 int armsoc_bo_has_dmabuf(struct armsoc_bo *bo);
 int armsoc_bo_clear(struct armsoc_bo *bo);
+void armsoc_zero_stream(void *dst, size_t len);
 int armsoc_bo_rm_fb(struct armsoc_bo *bo);
+uint32_t armsoc_bo_release_fb(struct armsoc_bo *bo);
+void armsoc_bo_restore_fb(struct armsoc_bo *bo, uint32_t width,
+		uint32_t height, uint32_t pitch, uint32_t size,
+		uint32_t fb_id);
+int armsoc_bo_can_resize(struct armsoc_bo *bo, uint32_t new_width,
+						uint32_t new_height);
 int armsoc_bo_resize(struct armsoc_bo *bo, uint32_t new_width,
 						uint32_t new_height);
 
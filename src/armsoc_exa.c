@@ -75,6 +75,167 @@ ARMSOCPixmapExchange(PixmapPtr a, PixmapPtr b)
 	}
 }
 
+/* How long to wait before trying to fill the pool again after an
+ * allocation failed, in milliseconds */
+#define ARMSOC_SCANOUT_POOL_RETRY 1000
+
+/**
+ * Take a scanout bo, with an fb already attached, from the pool of
+ * pre-allocated screen-sized buffers. Returns NULL if the pool is empty or
+ * the requested dimensions don't match the pool; the caller then has to
+ * allocate the bo itself. The caller gets a ref on the bo of its own; the
+ * pool keeps one to take the bo back once the caller is done with it.
+ */
+struct armsoc_bo *
+armsoc_scanout_pool_get(ScrnInfoPtr pScrn, int width, int height,
+		int depth, int bpp)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_bo *bo;
+	int i;
+
+	if (!pARMSOC->scanout_pool_count)
+		return NULL;
+
+	bo = pARMSOC->scanout_pool[pARMSOC->scanout_pool_count - 1];
+	if (armsoc_bo_width(bo) != width ||
+	    armsoc_bo_height(bo) != height ||
+	    armsoc_bo_depth(bo) != depth ||
+	    armsoc_bo_bpp(bo) != bpp)
+		return NULL;
+
+	pARMSOC->scanout_pool[--pARMSOC->scanout_pool_count] = NULL;
+
+	/* There is a slot for every bo the pool owns */
+	for (i = 0; pARMSOC->scanout_pool_out[i]; i++)
+		assert(i < pARMSOC->scanout_pool_size - 1);
+	pARMSOC->scanout_pool_out[i] = bo;
+
+	/* Caller takes a ref on the bo */
+	armsoc_bo_reference(bo);
+	return bo;
+}
+
+/* Whether a bo can go back in the pool as it is. One that was given a
+ * name or dmabuf fd can't: the client it went to may still have it open,
+ * and would share it with the next one. */
+static Bool
+armsoc_scanout_pool_fits(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
+{
+	return !armsoc_bo_exported(bo) &&
+	       armsoc_bo_width(bo) == pScrn->virtualX &&
+	       armsoc_bo_height(bo) == pScrn->virtualY &&
+	       armsoc_bo_depth(bo) == pScrn->depth &&
+	       armsoc_bo_bpp(bo) == pScrn->bitsPerPixel &&
+	       armsoc_bo_get_fb(bo);
+}
+
+/**
+ * Top up the scanout bo pool with buffers of the current screen size.
+ * Called at startup and from the block handler, so allocation and fb
+ * creation happen outside of the swap path.
+ *
+ * Bos handed out come back to the pool once only the pool holds them,
+ * unless they were exported, in which case fresh ones are allocated in
+ * their place. While any is still in use by a client nothing new is
+ * allocated: the
+ * client has the buffers it needs, and refilling behind it would double
+ * the memory it takes for as long as it runs.
+ */
+void
+armsoc_scanout_pool_fill(ScrnInfoPtr pScrn)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct armsoc_bo *bo;
+	int i, in_use = 0;
+
+	for (i = 0; i < pARMSOC->scanout_pool_size; i++) {
+		bo = pARMSOC->scanout_pool_out[i];
+		if (!bo)
+			continue;
+
+		if (armsoc_bo_refcount(bo) > 1) {
+			/* One that ended up as the screen's scanout has
+			 * stood in for the bo the screen had before */
+			if (bo != pARMSOC->scanout)
+				in_use++;
+			continue;
+		}
+
+		pARMSOC->scanout_pool_out[i] = NULL;
+		if (armsoc_scanout_pool_fits(pScrn, bo))
+			pARMSOC->scanout_pool[pARMSOC->scanout_pool_count++] =
+					bo;
+		else
+			/* Pool drops its ref on the bo */
+			armsoc_bo_unreference(bo);
+	}
+
+	if (in_use)
+		return;
+
+	if (pARMSOC->scanout_pool_retry &&
+	    (INT32)(GetTimeInMillis() - pARMSOC->scanout_pool_retry) < 0)
+		return;
+
+	while (pARMSOC->scanout_pool_count < pARMSOC->scanout_pool_size) {
+		/* Pool creates and holds a ref on its bos */
+		bo = armsoc_bo_new_with_dim(pARMSOC->dev,
+				pScrn->virtualX, pScrn->virtualY,
+				pScrn->depth, pScrn->bitsPerPixel,
+				ARMSOC_BO_SCANOUT);
+
+		if (bo && armsoc_bo_add_fb(bo)) {
+			armsoc_bo_unreference(bo);
+			bo = NULL;
+		}
+
+		if (!bo) {
+			/* Try again later rather than from every block
+			 * handler call */
+			if (!pARMSOC->scanout_pool_retry)
+				WARNING_MSG("Scanout pool allocation failed, %d of %d buffers allocated",
+					pARMSOC->scanout_pool_count,
+					pARMSOC->scanout_pool_size);
+			pARMSOC->scanout_pool_retry = GetTimeInMillis() +
+					ARMSOC_SCANOUT_POOL_RETRY;
+			if (!pARMSOC->scanout_pool_retry)
+				pARMSOC->scanout_pool_retry = 1;
+			return;
+		}
+
+		pARMSOC->scanout_pool[pARMSOC->scanout_pool_count++] = bo;
+	}
+	pARMSOC->scanout_pool_retry = 0;
+}
+
+/**
+ * Release all buffers in the scanout bo pool, e.g. because the screen size
+ * changed and they can no longer be used. Bos handed out stay with their
+ * users, but don't come back.
+ */
+void
+armsoc_scanout_pool_flush(ScrnInfoPtr pScrn)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	int i;
+
+	while (pARMSOC->scanout_pool_count > 0) {
+		int idx = --pARMSOC->scanout_pool_count;
+
+		/* Pool drops its ref on the bo */
+		armsoc_bo_unreference(pARMSOC->scanout_pool[idx]);
+		pARMSOC->scanout_pool[idx] = NULL;
+	}
+
+	for (i = 0; i < pARMSOC->scanout_pool_size; i++) {
+		/* Pool drops its ref on the bo */
+		armsoc_bo_unreference(pARMSOC->scanout_pool_out[i]);
+		pARMSOC->scanout_pool_out[i] = NULL;
+	}
+	pARMSOC->scanout_pool_retry = 0;
+}
+
 _X_EXPORT void *
 ARMSOCCreatePixmap2(ScreenPtr pScreen, int width, int height,
 		int depth, int usage_hint, int bitsPerPixel,
@@ -92,12 +253,18 @@ ARMSOCCreatePixmap2(ScreenPtr pScreen, int width, int height,
 		buf_type = ARMSOC_BO_SCANOUT;
 
 	if (width > 0 && height > 0 && depth > 0 && bitsPerPixel > 0) {
+		/* Pixmap takes a ref on a pre-allocated bo */
+		if (ARMSOC_BO_SCANOUT == buf_type)
+			priv->bo = armsoc_scanout_pool_get(pScrn, width, height,
+					depth, bitsPerPixel);
+
 		/* Pixmap creates and takes a ref on its bo */
-		priv->bo = armsoc_bo_new_with_dim(pARMSOC->dev,
-				width,
-				height,
-				depth,
-				bitsPerPixel, buf_type);
+		if (!priv->bo)
+			priv->bo = armsoc_bo_new_with_dim(pARMSOC->dev,
+					width,
+					height,
+					depth,
+					bitsPerPixel, buf_type);
 
 		if ((!priv->bo) && ARMSOC_BO_SCANOUT == buf_type) {
 			/* Tried to create a scanout but failed. Attempt to
@@ -49,17 +49,60 @@
 #include "X11/Xatom.h"
 
 #include <libudev.h>
+#include <sys/mman.h>
+#include <time.h>
 #include "drmmode_driver.h"
 
+/* How long the vblank clock model is trusted without hearing from the
+ * kernel, in microseconds.
+ */
+#define ARMSOC_VBLANK_RESYNC_USEC	1000000
+
+/* Frame period of the software vblank source when the mode doesn't give
+ * us one, in microseconds (60Hz).
+ */
+#define ARMSOC_SOFT_VBLANK_PERIOD	16667
+
+/* A WaitMSC waiting on the software vblank source */
+struct drmmode_soft_vblank {
+	struct drmmode_soft_vblank *next;
+	xf86CrtcPtr crtc;
+	uint64_t target_msc;
+	void *data;
+};
+
+/* Number of cursor images kept in buffers of their own */
+#define ARMSOC_CURSOR_CACHE_SIZE 8
+
+/* A cursor image loaded in a buffer the hardware can show */
+struct drmmode_cursor_image {
+	struct armsoc_bo *bo;
+	uint32_t fb_id;		/* HWCURSOR_API_PLANE */
+	uint32_t hash;
+	CARD32 *argb;		/* the image, to tell apart hash collisions */
+	unsigned int last_used;
+};
+
 struct drmmode_cursor_rec {
-	/* hardware cursor: */
+	/* hardware cursor: the buffer being shown, from images[current] */
 	struct armsoc_bo *bo;
-	int x, y;
-	 /* These are used for HWCURSOR_API_PLANE */
+	 /* These are used for HWCURSOR_API_PLANE. When there aren't
+	  * planes for every CRTC, ovr is one plane moved between them,
+	  * currently on plane_crtc_id */
 	drmModePlane *ovr;
+	uint32_t plane_crtc_id;
 	uint32_t fb_id;
 	/* This is used for HWCURSOR_API_STANDARD */
 	uint32_t handle;
+	/* Recently loaded images, so that switching back to one, as
+	 * animated cursors do, needs no copying */
+	struct drmmode_cursor_image images[ARMSOC_CURSOR_CACHE_SIZE];
+	int current;
+	unsigned int use_count;
+	/* sends moves held back to keep to one per frame, and when it
+	 * fires in microseconds; 0 if it isn't armed */
+	OsTimerPtr move_timer;
+	uint64_t move_deadline;
 };
 
 struct drmmode_rec {
@@ -69,12 +112,85 @@ struct drmmode_rec {
 	struct udev_monitor *uevent_monitor;
 	InputHandlerProc uevent_handler;
 	struct drmmode_cursor_rec *cursor;
+	/* kernel supports DRM_MODE_PAGE_FLIP_ASYNC */
+	Bool async_flip_supported;
+	/* displays are programmed with atomic commits */
+	Bool atomic;
+	/* framebuffer of a scanout bo resized in place, removed once the
+	 * CRTCs have moved to the new one */
+	uint32_t retired_fb_id;
+	/* kernel supports the 64-bit CRTC sequence ioctls */
+	Bool crtc_sequence_supported;
+	/* whether vblank queries have been tried on a lit CRTC yet */
+	Bool vblank_probed;
+	/* pending events of the software vblank source */
+	struct drmmode_soft_vblank *soft_vblanks;
+	OsTimerPtr soft_vblank_timer;
+	/* when the timer fires, in microseconds; 0 if it isn't armed */
+	uint64_t soft_vblank_deadline;
+};
+
+/* Primary plane properties set by atomic commits */
+enum {
+	DRMMODE_PLANE_FB_ID,
+	DRMMODE_PLANE_CRTC_ID,
+	DRMMODE_PLANE_SRC_X,
+	DRMMODE_PLANE_SRC_Y,
+	DRMMODE_PLANE_SRC_W,
+	DRMMODE_PLANE_SRC_H,
+	DRMMODE_PLANE_CRTC_X,
+	DRMMODE_PLANE_CRTC_Y,
+	DRMMODE_PLANE_CRTC_W,
+	DRMMODE_PLANE_CRTC_H,
+	DRMMODE_PLANE_PROP_COUNT
 };
 
 struct drmmode_crtc_private_rec {
 	struct drmmode_rec *drmmode;
 	uint32_t crtc_id;
+	/* index of the CRTC in the kernel's list, used to select it in
+	 * vblank requests */
+	int pipe;
+	int dpms_mode;
+	/* framebuffer the CRTC is scanning out, 0 while it is off */
+	uint32_t scanout_fb_id;
+	/* with PerCrtcScanout, the buffer of this CRTC, and the one that is
+	 * drawn to and flipped to while it is being scanned out */
+	struct armsoc_bo *scanout;
+	struct armsoc_bo *scanout_back;
+	/* in screen coordinates: what has been drawn but isn't on the CRTC
+	 * yet, and what scanout_back is missing of what scanout shows */
+	RegionRec scanout_damage;
+	RegionRec scanout_stale;
+	Bool scanout_flip_pending;
+	/* atomic modesetting: the primary plane, the property ids we set
+	 * and the blob holding the current mode */
+	uint32_t primary_plane_id;
+	uint32_t prop_active;
+	uint32_t prop_mode_id;
+	uint32_t plane_props[DRMMODE_PLANE_PROP_COUNT];
+	uint32_t mode_blob_id;
 	int cursor_visible;
+	/* HWCURSOR_API_PLANE: the plane showing the cursor on this CRTC,
+	 * and with atomic modesetting the property ids flips set on it */
+	drmModePlane *cursor_plane;
+	uint32_t cursor_plane_props[DRMMODE_PLANE_PROP_COUNT];
+	/* cursor position, and when it was last sent to the kernel; a
+	 * move arriving sooner than a frame after that is held back */
+	int cursor_x, cursor_y;
+	uint64_t cursor_update_usec;
+	Bool cursor_move_pending;
+	/* vblank clock model: the last vblank we know of and the frame
+	 * period, used to answer MSC/UST queries without an ioctl.
+	 * Only valid while vbl_serial matches crtc_config_serial.
+	 */
+	Bool vbl_valid;
+	unsigned int vbl_serial;
+	uint64_t vbl_msc;
+	uint64_t vbl_ust;
+	uint32_t vbl_period;
+	/* the highest count the software vblank source has reported */
+	uint64_t vbl_soft_msc;
 	/* settings retained on last good modeset */
 	int last_good_x;
 	int last_good_y;
@@ -103,11 +219,34 @@ struct drmmode_output_priv {
 	struct drmmode_prop_rec *props;
 	int enc_mask;   /* encoders present (mask of encoder indices) */
 	int enc_clones; /* encoder clones possible (mask of encoder indices) */
+	/* atomic modesetting: id of the CRTC_ID property, and the CRTC the
+	 * connector was last committed to */
+	uint32_t prop_crtc_id;
+	uint32_t atomic_crtc_id;
+	/* while a hotplug event is handled: the event left the connector
+	 * as it was, so it isn't probed again */
+	Bool unchanged;
+	/* ids of the EDID and DPMS properties, 0 if there is none */
+	uint32_t prop_edid;
+	uint32_t prop_dpms;
+	/* the modes last made from the connector, and the EDID and kernel
+	 * modes they, and the output's monitor, were made from: a hash, and
+	 * a copy of the EDID followed by the modes to confirm a match */
+	DisplayModePtr modes;
+	uint32_t modes_hash;
+	uint8_t *modes_key;
+	size_t modes_edid_len, modes_kmodes_len;
+	Bool modes_valid;
 };
 
 static void drmmode_output_dpms(xf86OutputPtr output, int mode);
 static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height);
+static void drmmode_retire_fb(ScrnInfoPtr pScrn);
+static uint64_t drmmode_monotonic_usec(void);
+static uint32_t drmmode_mode_frame_period(const DisplayModeRec *mode);
 static Bool drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode, Rotation rotation, int x, int y);
+static void drmmode_cursor_plane_rect(xf86CrtcPtr crtc, int *crtc_x,
+		int *crtc_y, int *w, int *h, int *src_x, int *src_y);
 
 static struct drmmode_rec *
 drmmode_from_scrn(ScrnInfoPtr pScrn)
@@ -179,275 +318,1495 @@ drmmode_ConvertToKMode(ScrnInfoPtr pScrn, drmModeModeInfo *kmode,
 	kmode->name[DRM_DISPLAY_MODE_LEN-1] = 0;
 }
 
-static void
-drmmode_crtc_dpms(xf86CrtcPtr crtc, int mode)
+/*
+ * Atomic modesetting: with the Atomic option, modesets are checked with a
+ * TEST_ONLY commit before anything is changed, and flips of several CRTCs
+ * go to the kernel as one nonblocking commit.
+ */
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+static const char * const drmmode_plane_prop_names[DRMMODE_PLANE_PROP_COUNT] = {
+	[DRMMODE_PLANE_FB_ID] = "FB_ID",
+	[DRMMODE_PLANE_CRTC_ID] = "CRTC_ID",
+	[DRMMODE_PLANE_SRC_X] = "SRC_X",
+	[DRMMODE_PLANE_SRC_Y] = "SRC_Y",
+	[DRMMODE_PLANE_SRC_W] = "SRC_W",
+	[DRMMODE_PLANE_SRC_H] = "SRC_H",
+	[DRMMODE_PLANE_CRTC_X] = "CRTC_X",
+	[DRMMODE_PLANE_CRTC_Y] = "CRTC_Y",
+	[DRMMODE_PLANE_CRTC_W] = "CRTC_W",
+	[DRMMODE_PLANE_CRTC_H] = "CRTC_H",
+};
+#endif
+
+#ifdef DRM_CLIENT_CAP_UNIVERSAL_PLANES
+/* Look up a property of a KMS object by name. Returns its id, or 0 if the
+ * object doesn't have it, and its current value in *value if asked for.
+ * Plane types come with universal planes, which any libdrm that knows
+ * about atomic modesetting has too, so this is built with either.
+ */
+static uint32_t
+drmmode_prop_lookup(int fd, uint32_t obj_id, uint32_t obj_type,
+		const char *name, uint64_t *value)
 {
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	ScrnInfoPtr pScrn = crtc->scrn;
+	drmModeObjectPropertiesPtr props;
+	uint32_t prop_id = 0;
+	uint32_t i;
 
-	DEBUG_MSG("Setting dpms mode %d on crtc %d", mode, drmmode_crtc->crtc_id);
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return 0;
 
-	switch (mode) {
-	case DPMSModeOn:
-		drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, crtc->x, crtc->y);
-		break;
+	for (i = 0; i < props->count_props && !prop_id; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd,
+				props->props[i]);
 
-	/* unimplemented modes fall through to the next lowest mode */
-	case DPMSModeStandby:
-	case DPMSModeSuspend:
-	case DPMSModeOff:
-		if (drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id, 0, 0, 0, 0, 0, NULL)) {
-			ERROR_MSG("drm failed to disable crtc %d", drmmode_crtc->crtc_id);
-		} else {
-			int i;
-			xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+		if (!prop)
+			continue;
 
-			/* set dpms off for all outputs for this crtc */
-			for (i = 0; i < xf86_config->num_output; i++) {
-				xf86OutputPtr output = xf86_config->output[i];
-				if (output->crtc != crtc)
-					continue;
-				drmmode_output_dpms(output, mode);
-			}
+		if (!strcmp(prop->name, name)) {
+			prop_id = prop->prop_id;
+			if (value)
+				*value = props->prop_values[i];
 		}
-		break;
-	default:
-		ERROR_MSG("bad dpms mode %d for crtc %d", mode, drmmode_crtc->crtc_id);
-		return;
+		drmModeFreeProperty(prop);
 	}
+
+	drmModeFreeObjectProperties(props);
+	return prop_id;
 }
+#endif
 
-static int
-drmmode_revert_mode(xf86CrtcPtr crtc, uint32_t *output_ids, int output_count)
+#ifdef DRM_CLIENT_CAP_ATOMIC
+
+/* Read the current value of a property whose id was looked up before.
+ * Returns FALSE if the object doesn't have it. */
+static Bool
+drmmode_prop_value(int fd, uint32_t obj_id, uint32_t obj_type,
+		uint32_t prop_id, uint64_t *value)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	uint32_t fb_id;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	drmModeModeInfo kmode;
+	drmModeObjectPropertiesPtr props;
+	Bool found = FALSE;
+	uint32_t i;
 
-	if (!drmmode_crtc->last_good_mode) {
-		DEBUG_MSG("No last good values to use");
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
 		return FALSE;
-	}
 
-	/* revert to last good settings */
-	DEBUG_MSG("Reverting to last_good values");
-	if (!resize_scanout_bo(pScrn,
-			drmmode_crtc->last_good_mode->HDisplay,
-			drmmode_crtc->last_good_mode->VDisplay)) {
-		ERROR_MSG("Could not revert to last good mode");
-		return FALSE;
+	for (i = 0; i < props->count_props && !found; i++) {
+		if (props->props[i] == prop_id) {
+			*value = props->prop_values[i];
+			found = TRUE;
+		}
 	}
 
-	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-	drmmode_ConvertToKMode(crtc->scrn, &kmode,
-			drmmode_crtc->last_good_mode);
-	drmModeSetCrtc(drmmode_crtc->drmmode->fd,
-			drmmode_crtc->crtc_id,
-			fb_id,
-			drmmode_crtc->last_good_x,
-			drmmode_crtc->last_good_y,
-			output_ids, output_count, &kmode);
-
-	/* let RandR know we changed things */
-	xf86RandR12TellChanged(pScrn->pScreen);
-
-	return TRUE;
+	drmModeFreeObjectProperties(props);
+	return found;
 }
 
-static Bool
-drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
-		Rotation rotation, int x, int y)
+static uint32_t
+drmmode_find_primary_plane(struct drmmode_rec *drmmode,
+		drmModePlaneResPtr planes, int pipe)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	uint32_t *output_ids = NULL;
-	int output_count = 0;
-	int ret = TRUE;
-	int err;
-	int i;
-	uint32_t fb_id;
-	drmModeModeInfo kmode;
-	drmModeCrtcPtr newcrtc = NULL;
+	uint32_t plane_id = 0;
+	uint32_t i;
 
-	TRACE_ENTER();
+	for (i = 0; i < planes->count_planes && !plane_id; i++) {
+		drmModePlanePtr plane = drmModeGetPlane(drmmode->fd,
+				planes->planes[i]);
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
 
-	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+		if (!plane)
+			continue;
 
-	if (fb_id == 0) {
-		DEBUG_MSG("create framebuffer: %dx%d",
-				pScrn->virtualX, pScrn->virtualY);
+		drmmode_prop_lookup(drmmode->fd, plane->plane_id,
+				DRM_MODE_OBJECT_PLANE, "type", &type);
+		if (type == DRM_PLANE_TYPE_PRIMARY &&
+		    (plane->possible_crtcs & (1 << pipe)))
+			plane_id = plane->plane_id;
+		drmModeFreePlane(plane);
+	}
 
-		err = armsoc_bo_add_fb(pARMSOC->scanout);
-		if (err) {
-			ERROR_MSG(
-					"Failed to add framebuffer to the scanout buffer");
-			return FALSE;
-		}
+	return plane_id;
+}
 
-		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
-		if (0 == fb_id)
-			return FALSE;
-	}
+/**
+ * Switch the DRM connection to atomic modesetting and look up the planes
+ * and properties we need. Returns FALSE, with the connection left as it
+ * was, if the kernel or any of the CRTCs can't do it.
+ */
+static Bool
+drmmode_atomic_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmModePlaneResPtr planes;
+	int i, j;
 
-	/* Set the new mode: */
-	crtc->mode = *mode;
-	crtc->x = x;
-	crtc->y = y;
-	crtc->rotation = rotation;
+	if (drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_ATOMIC, 1))
+		return FALSE;
 
-	output_ids = calloc(xf86_config->num_output, sizeof *output_ids);
-	if (!output_ids) {
-		ERROR_MSG(
-				"memory allocation failed in drmmode_set_mode_major()");
-		ret = FALSE;
-		goto cleanup;
-	}
+	planes = drmModeGetPlaneResources(drmmode->fd);
+	if (!planes)
+		goto fail;
 
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
-		struct drmmode_output_priv *drmmode_output;
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		drmmode_crtc->primary_plane_id = drmmode_find_primary_plane(
+				drmmode, planes, drmmode_crtc->pipe);
+		if (!drmmode_crtc->primary_plane_id) {
+			INFO_MSG("No primary plane for crtc %d",
+					drmmode_crtc->crtc_id);
+			drmModeFreePlaneResources(planes);
+			goto fail;
+		}
 
-		if (output->crtc != crtc)
-			continue;
+		drmmode_crtc->prop_active = drmmode_prop_lookup(drmmode->fd,
+				drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC,
+				"ACTIVE", NULL);
+		drmmode_crtc->prop_mode_id = drmmode_prop_lookup(drmmode->fd,
+				drmmode_crtc->crtc_id, DRM_MODE_OBJECT_CRTC,
+				"MODE_ID", NULL);
+		if (!drmmode_crtc->prop_active || !drmmode_crtc->prop_mode_id) {
+			drmModeFreePlaneResources(planes);
+			goto fail;
+		}
 
-		drmmode_output = output->driver_private;
-		output_ids[output_count] =
-				drmmode_output->connector->connector_id;
-		output_count++;
+		for (j = 0; j < DRMMODE_PLANE_PROP_COUNT; j++) {
+			drmmode_crtc->plane_props[j] = drmmode_prop_lookup(
+					drmmode->fd,
+					drmmode_crtc->primary_plane_id,
+					DRM_MODE_OBJECT_PLANE,
+					drmmode_plane_prop_names[j], NULL);
+			if (!drmmode_crtc->plane_props[j]) {
+				drmModeFreePlaneResources(planes);
+				goto fail;
+			}
+		}
 	}
-
-	if (!xf86CrtcRotate(crtc)) {
-		ERROR_MSG(
-				"failed to assign rotation in drmmode_set_mode_major()");
-		ret = FALSE;
-		goto cleanup;
+	drmModeFreePlaneResources(planes);
+
+	for (i = 0; i < config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				config->output[i]->driver_private;
+		uint64_t crtc_id = 0;
+
+		drmmode_output->prop_crtc_id = drmmode_prop_lookup(drmmode->fd,
+				drmmode_output->output_id,
+				DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", &crtc_id);
+		if (!drmmode_output->prop_crtc_id)
+			goto fail;
+		drmmode_output->atomic_crtc_id = crtc_id;
 	}
 
-	if (crtc->funcs->gamma_set)
-		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
-				       crtc->gamma_blue, crtc->gamma_size);
-
-	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+	drmmode->atomic = TRUE;
+	return TRUE;
 
-	err = drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id,
-			fb_id, x, y, output_ids, output_count, &kmode);
-	if (err) {
-		ERROR_MSG(
-				"drm failed to set mode: %s", strerror(-err));
+fail:
+	drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_ATOMIC, 0);
+	return FALSE;
+}
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
-	}
+/* Atomic equivalent of drmModeSetCrtc(), or with test_only a check that
+ * the kernel would accept it which changes nothing. Returns 0 or -errno. */
+static int
+drmmode_crtc_atomic_set(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		drmModeModeInfo *kmode, Bool test_only)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	uint32_t plane_id = drmmode_crtc->primary_plane_id;
+	uint32_t *props = drmmode_crtc->plane_props;
+	drmModeAtomicReqPtr req;
+	uint32_t blob_id;
+	int i, ret;
 
-	/* get the actual crtc info */
-	newcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
-	if (!newcrtc) {
-		ERROR_MSG("couldn't get actual mode back");
+	if (drmModeCreatePropertyBlob(drmmode->fd, kmode, sizeof(*kmode),
+			&blob_id))
+		return -errno;
 
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return -ENOMEM;
 	}
 
-	if (kmode.hdisplay != newcrtc->mode.hdisplay ||
-		kmode.vdisplay != newcrtc->mode.vdisplay) {
-
-		ERROR_MSG(
-			"drm did not set requested mode! (requested %dx%d, actual %dx%d)",
-			kmode.hdisplay, kmode.vdisplay,
-			newcrtc->mode.hdisplay,
-			newcrtc->mode.vdisplay);
-
-		ret = FALSE;
-		if (!drmmode_revert_mode(crtc, output_ids, output_count))
-			goto cleanup;
-		else
-			goto done_setting;
+	drmModeAtomicAddProperty(req, drmmode_crtc->crtc_id,
+			drmmode_crtc->prop_mode_id, blob_id);
+	drmModeAtomicAddProperty(req, drmmode_crtc->crtc_id,
+			drmmode_crtc->prop_active, 1);
+
+	for (i = 0; i < config->num_output; i++) {
+		xf86OutputPtr output = config->output[i];
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
+
+		if (output->crtc == crtc)
+			drmModeAtomicAddProperty(req, drmmode_output->output_id,
+					drmmode_output->prop_crtc_id,
+					drmmode_crtc->crtc_id);
+		else if (drmmode_output->atomic_crtc_id == drmmode_crtc->crtc_id)
+			drmModeAtomicAddProperty(req, drmmode_output->output_id,
+					drmmode_output->prop_crtc_id, 0);
 	}
 
-	/* When called on a resize, crtc->mode already contains the
-	 * resized values so we can't use this for recovery.
-	 * We can't read it out of the crtc either as mode_valid is 0.
-	 * Instead we save the last good mode set here & fallback to
-	 * that on failure.
-	 */
-	DEBUG_MSG("Saving last good values");
-	drmmode_crtc->last_good_x = crtc->x;
-	drmmode_crtc->last_good_y = crtc->y;
-	drmmode_crtc->last_good_rotation = crtc->rotation;
-	if (drmmode_crtc->last_good_mode) {
-		if (drmmode_crtc->last_good_mode->name)
-			free((void *)drmmode_crtc->last_good_mode->name);
-		free(drmmode_crtc->last_good_mode);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_FB_ID],
+			fb_id);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_ID],
+			drmmode_crtc->crtc_id);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_X],
+			(uint64_t)x << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_Y],
+			(uint64_t)y << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_W],
+			(uint64_t)kmode->hdisplay << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_H],
+			(uint64_t)kmode->vdisplay << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_X], 0);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_Y], 0);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_W],
+			kmode->hdisplay);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_H],
+			kmode->vdisplay);
+
+	ret = drmModeAtomicCommit(drmmode->fd, req,
+			DRM_MODE_ATOMIC_ALLOW_MODESET |
+			(test_only ? DRM_MODE_ATOMIC_TEST_ONLY : 0), NULL);
+	if (ret)
+		ret = -errno;
+	drmModeAtomicFree(req);
+
+	if (ret || test_only) {
+		drmModeDestroyPropertyBlob(drmmode->fd, blob_id);
+		return ret;
 	}
-	drmmode_crtc->last_good_mode = xf86DuplicateMode(&crtc->mode);
 
-	ret = TRUE;
-
-done_setting:
-	/* Turn on any outputs on this crtc that may have been disabled: */
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
+	if (drmmode_crtc->mode_blob_id)
+		drmModeDestroyPropertyBlob(drmmode->fd,
+				drmmode_crtc->mode_blob_id);
+	drmmode_crtc->mode_blob_id = blob_id;
 
-		if (output->crtc != crtc)
-			continue;
+	for (i = 0; i < config->num_output; i++) {
+		xf86OutputPtr output = config->output[i];
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
 
-		drmmode_output_dpms(output, DPMSModeOn);
+		if (output->crtc == crtc)
+			drmmode_output->atomic_crtc_id = drmmode_crtc->crtc_id;
+		else if (drmmode_output->atomic_crtc_id == drmmode_crtc->crtc_id)
+			drmmode_output->atomic_crtc_id = 0;
 	}
 
-	/* if hw cursor is initialized, reload it */
-	if (drmmode->cursor)
-		xf86_reload_cursors(pScrn->pScreen);
+	return 0;
+}
 
-cleanup:
-	if (newcrtc)
-		drmModeFreeCrtc(newcrtc);
+/* Turn a CRTC off, keeping its mode and connectors for when it comes back */
+static int
+drmmode_crtc_atomic_off(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	drmModeAtomicReqPtr req;
+	int ret;
 
-	if (output_ids)
-		free(output_ids);
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
 
-	if (!ret && drmmode_crtc->last_good_mode) {
-		/* If there was a problem, restore the last good mode: */
-		crtc->x = drmmode_crtc->last_good_x;
-		crtc->y = drmmode_crtc->last_good_y;
-		crtc->rotation = drmmode_crtc->last_good_rotation;
-		crtc->mode = *drmmode_crtc->last_good_mode;
-	}
+	drmModeAtomicAddProperty(req, drmmode_crtc->crtc_id,
+			drmmode_crtc->prop_active, 0);
+	ret = drmModeAtomicCommit(drmmode->fd, req,
+			DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (ret)
+		ret = -errno;
+	drmModeAtomicFree(req);
 
-	TRACE_EXIT();
 	return ret;
 }
 
-static void
-drmmode_hide_cursor(xf86CrtcPtr crtc)
+/* Move the part of the framebuffer a CRTC shows, without a modeset.
+ * Returns 0 or -errno. */
+static int
+drmmode_crtc_atomic_pan(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y)
 {
 	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
 	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	uint32_t plane_id = drmmode_crtc->primary_plane_id;
+	uint32_t *props = drmmode_crtc->plane_props;
+	drmModeAtomicReqPtr req;
+	int ret;
 
-	if (!cursor)
-		return;
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_FB_ID],
+			fb_id);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_X],
+			(uint64_t)x << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_Y],
+			(uint64_t)y << 16);
+	ret = drmModeAtomicCommit(drmmode->fd, req, 0, NULL);
+	if (ret)
+		ret = -errno;
+	drmModeAtomicFree(req);
+
+	return ret;
+}
+
+/* Look up the properties of the CRTCs' cursor planes that flips set. A
+ * CRTC whose plane lacks any of them keeps its cursor out of the flips. */
+static void
+drmmode_cursor_atomic_init(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	int i, j;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (!drmmode_crtc->cursor_plane)
+			continue;
+
+		for (j = 0; j < DRMMODE_PLANE_PROP_COUNT; j++) {
+			drmmode_crtc->cursor_plane_props[j] =
+					drmmode_prop_lookup(drmmode->fd,
+					drmmode_crtc->cursor_plane->plane_id,
+					DRM_MODE_OBJECT_PLANE,
+					drmmode_plane_prop_names[j], NULL);
+			if (!drmmode_crtc->cursor_plane_props[j]) {
+				memset(drmmode_crtc->cursor_plane_props, 0,
+					sizeof(drmmode_crtc->cursor_plane_props));
+				break;
+			}
+		}
+	}
+}
+
+/* Put the cursor of a CRTC, with any move held back, in a flip commit so
+ * that it changes on the same vblank as the frame under it */
+static void
+drmmode_cursor_atomic_add(drmModeAtomicReqPtr req, xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_cursor_rec *cursor = drmmode_crtc->drmmode->cursor;
+	uint32_t *props = drmmode_crtc->cursor_plane_props;
+	uint32_t plane_id;
+	int crtc_x, crtc_y, w, h, src_x, src_y;
+
+	if (!cursor || !drmmode_crtc->cursor_visible ||
+	    !props[DRMMODE_PLANE_FB_ID] ||
+	    cursor->plane_crtc_id != drmmode_crtc->crtc_id)
+		return;
+
+	plane_id = drmmode_crtc->cursor_plane->plane_id;
+	drmmode_cursor_plane_rect(crtc, &crtc_x, &crtc_y, &w, &h,
+			&src_x, &src_y);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_FB_ID],
+			cursor->fb_id);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_ID],
+			drmmode_crtc->crtc_id);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_X],
+			(uint64_t)src_x << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_Y],
+			(uint64_t)src_y << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_W],
+			(uint64_t)w << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_SRC_H],
+			(uint64_t)h << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_X],
+			crtc_x);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_Y],
+			crtc_y);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_W],
+			w);
+	drmModeAtomicAddProperty(req, plane_id, props[DRMMODE_PLANE_CRTC_H],
+			h);
+}
+
+/* Flip the primary planes of the CRTCs in crtc_mask, with their cursor
+ * planes, in one nonblocking commit. Returns 0, or -1 with errno set. */
+static int
+drmmode_atomic_flip(ScrnInfoPtr pScrn, uint32_t crtc_mask, uint32_t fb_id,
+		uint32_t flags, void *priv)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	drmModeAtomicReqPtr req;
+	int i, ret;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (!(crtc_mask & (1 << i)))
+			continue;
+
+		drmModeAtomicAddProperty(req,
+				drmmode_crtc->primary_plane_id,
+				drmmode_crtc->plane_props[DRMMODE_PLANE_FB_ID],
+				fb_id);
+		drmmode_cursor_atomic_add(req, config->crtc[i]);
+	}
+
+	ret = drmModeAtomicCommit(drmmode->fd, req,
+			flags | DRM_MODE_ATOMIC_NONBLOCK, priv);
+	drmModeAtomicFree(req);
+
+	/* the moves held back have gone out with the flip */
+	if (!ret) {
+		for (i = 0; i < config->num_crtc; i++) {
+			struct drmmode_crtc_private_rec *drmmode_crtc =
+					config->crtc[i]->driver_private;
+
+			if ((crtc_mask & (1 << i)) &&
+			    drmmode_crtc->cursor_plane_props[DRMMODE_PLANE_FB_ID] &&
+			    drmmode_crtc->cursor_move_pending) {
+				drmmode_crtc->cursor_move_pending = FALSE;
+				drmmode_crtc->cursor_update_usec =
+						drmmode_monotonic_usec();
+			}
+		}
+	}
+
+	return ret;
+}
+#else
+static Bool
+drmmode_atomic_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode)
+{
+	return FALSE;
+}
+
+static int
+drmmode_crtc_atomic_set(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		drmModeModeInfo *kmode, Bool test_only)
+{
+	return -ENOSYS;
+}
+
+static int
+drmmode_crtc_atomic_off(xf86CrtcPtr crtc)
+{
+	return -ENOSYS;
+}
+
+static int
+drmmode_crtc_atomic_pan(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y)
+{
+	return -ENOSYS;
+}
+
+static int
+drmmode_atomic_flip(ScrnInfoPtr pScrn, uint32_t crtc_mask, uint32_t fb_id,
+		uint32_t flags, void *priv)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+static void
+drmmode_cursor_atomic_init(ScrnInfoPtr pScrn)
+{
+}
+#endif
+
+/* Whether a plane is the primary plane of one of our CRTCs */
+static Bool
+drmmode_plane_is_primary(ScrnInfoPtr pScrn, uint32_t plane_id)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->primary_plane_id == plane_id)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Program a CRTC, atomically when enabled. Returns 0 or -errno. */
+static int
+drmmode_crtc_program(xf86CrtcPtr crtc, uint32_t fb_id, int x, int y,
+		uint32_t *output_ids, int output_count, drmModeModeInfo *kmode)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+
+	if (drmmode->atomic)
+		return drmmode_crtc_atomic_set(crtc, fb_id, x, y, kmode,
+				FALSE);
+
+	return drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id, fb_id, x, y,
+			output_ids, output_count, kmode);
+}
+
+static void
+drmmode_crtc_dpms(xf86CrtcPtr crtc, int mode)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	ScrnInfoPtr pScrn = crtc->scrn;
+
+	DEBUG_MSG("Setting dpms mode %d on crtc %d", mode, drmmode_crtc->crtc_id);
+
+	drmmode_crtc->dpms_mode = mode;
+	ARMSOCPTR(pScrn)->crtc_config_serial++;
+
+	switch (mode) {
+	case DPMSModeOn:
+		drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, crtc->x, crtc->y);
+		break;
+
+	/* unimplemented modes fall through to the next lowest mode */
+	case DPMSModeStandby:
+	case DPMSModeSuspend:
+	case DPMSModeOff:
+		drmmode_crtc->scanout_fb_id = 0;
+		if (drmmode->atomic ?
+		    drmmode_crtc_atomic_off(crtc) :
+		    drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id, 0, 0, 0, 0, 0, NULL)) {
+			ERROR_MSG("drm failed to disable crtc %d", drmmode_crtc->crtc_id);
+		} else {
+			int i;
+			xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+			/* set dpms off for all outputs for this crtc */
+			for (i = 0; i < xf86_config->num_output; i++) {
+				xf86OutputPtr output = xf86_config->output[i];
+				if (output->crtc != crtc)
+					continue;
+				drmmode_output_dpms(output, mode);
+			}
+		}
+		break;
+	default:
+		ERROR_MSG("bad dpms mode %d for crtc %d", mode, drmmode_crtc->crtc_id);
+		return;
+	}
+}
+
+/*
+ * Per-CRTC scanout: with the PerCrtcScanout option each CRTC scans out a
+ * buffer of its own the size of its mode. What is drawn to the root pixmap
+ * is copied from the block handler to a second buffer, which the CRTC then
+ * flips to, so the copies don't show half done.
+ */
+
+/* Per-CRTC scanout flips are told apart from DRI2 swaps, whose commands
+ * are at least word aligned, by the lowest bit of the event data */
+#define DRMMODE_SCANOUT_FLIP	1
+
+static struct armsoc_bo *
+drmmode_crtc_scanout_new(xf86CrtcPtr crtc, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *bo;
+
+	DEBUG_MSG("allocating scanout for crtc %d: %dx%d",
+			drmmode_crtc->crtc_id, width, height);
+	bo = armsoc_bo_new_with_dim(pARMSOC->dev, width, height,
+			armsoc_bo_depth(pARMSOC->scanout),
+			armsoc_bo_bpp(pARMSOC->scanout),
+			ARMSOC_BO_SCANOUT);
+	if (!bo) {
+		ERROR_MSG("Cannot allocate scanout buffer for crtc %d",
+				drmmode_crtc->crtc_id);
+		return NULL;
+	}
+
+	if (armsoc_bo_add_fb(bo)) {
+		ERROR_MSG("Failed to add framebuffer to the crtc %d scanout",
+				drmmode_crtc->crtc_id);
+		armsoc_bo_unreference(bo);
+		return NULL;
+	}
+
+	return bo;
+}
+
+/**
+ * Get a scanout buffer for the CRTC to show mode with: the one it has if
+ * it is the right size, or a new one. The caller gets a reference.
+ */
+static struct armsoc_bo *
+drmmode_crtc_scanout_get(xf86CrtcPtr crtc, DisplayModePtr mode)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *bo = drmmode_crtc->scanout;
+
+	if (bo && armsoc_bo_width(bo) == mode->HDisplay &&
+	    armsoc_bo_height(bo) == mode->VDisplay) {
+		armsoc_bo_reference(bo);
+		return bo;
+	}
+
+	return drmmode_crtc_scanout_new(crtc, mode->HDisplay, mode->VDisplay);
+}
+
+/* Wait for a flip of the CRTC to its back buffer to complete, before
+ * anything else is done with its buffers */
+static void
+drmmode_crtc_scanout_wait(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+
+	while (drmmode_crtc->scanout_flip_pending)
+		drmmode_wait_for_event(crtc->scrn);
+}
+
+/**
+ * Make bo, which has just been filled from the whole screen, the CRTC's
+ * scanout buffer once the CRTC is showing it. A back buffer to match is
+ * allocated when it changes; without one the CRTC's buffer is written to
+ * while it is scanned out.
+ */
+static void
+drmmode_crtc_scanout_set(xf86CrtcPtr crtc, struct armsoc_bo *bo)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct armsoc_bo *old_scanout = drmmode_crtc->scanout;
+	BoxRec box;
+
+	/* Everything the back buffer had is out of date */
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = armsoc_bo_width(pARMSOC->scanout);
+	box.y2 = armsoc_bo_height(pARMSOC->scanout);
+	RegionUninit(&drmmode_crtc->scanout_stale);
+	RegionInit(&drmmode_crtc->scanout_stale, &box, 1);
+	RegionEmpty(&drmmode_crtc->scanout_damage);
+
+	if (bo == old_scanout)
+		return;
+
+	armsoc_bo_reference(bo); /* CRTC takes ref on its scanout bo */
+	drmmode_crtc->scanout = bo;
+	if (old_scanout)
+		armsoc_bo_unreference(old_scanout);
+
+	if (drmmode_crtc->scanout_back)
+		armsoc_bo_unreference(drmmode_crtc->scanout_back);
+	drmmode_crtc->scanout_back = drmmode_crtc_scanout_new(crtc,
+			armsoc_bo_width(bo), armsoc_bo_height(bo));
+	if (!drmmode_crtc->scanout_back)
+		WARNING_MSG("No back buffer for crtc %d, updates to it may tear",
+				drmmode_crtc->crtc_id);
+}
+
+/* Copy the part of region (in screen coordinates) shown by the CRTC from
+ * the root pixmap to the CRTC's scanout buffer bo.
+ */
+static void
+drmmode_crtc_scanout_copy(xf86CrtcPtr crtc, struct armsoc_bo *bo,
+		RegionPtr region)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	struct armsoc_bo *root = pARMSOC->scanout;
+	uint32_t cpp = (armsoc_bo_bpp(root) + 7) / 8;
+	uint32_t src_pitch = armsoc_bo_pitch(root);
+	uint32_t dst_pitch = armsoc_bo_pitch(bo);
+	uint8_t *src, *dst;
+	RegionRec clip;
+	BoxRec box;
+	BoxPtr rects;
+	int i, n, y;
+
+	box.x1 = max(crtc->x, 0);
+	box.y1 = max(crtc->y, 0);
+	box.x2 = min(crtc->x + (int)armsoc_bo_width(bo),
+			(int)armsoc_bo_width(root));
+	box.y2 = min(crtc->y + (int)armsoc_bo_height(bo),
+			(int)armsoc_bo_height(root));
+	if (box.x1 >= box.x2 || box.y1 >= box.y2)
+		return;
+
+	RegionInit(&clip, &box, 1);
+	RegionIntersect(&clip, &clip, region);
+	n = RegionNumRects(&clip);
+	rects = RegionRects(&clip);
+
+	src = armsoc_bo_map(root);
+	dst = armsoc_bo_map(bo);
+	if (n && src && dst) {
+		armsoc_bo_cpu_prep(root, ARMSOC_GEM_READ);
+		armsoc_bo_cpu_prep(bo, ARMSOC_GEM_WRITE);
+		for (i = 0; i < n; i++) {
+			uint32_t len = (rects[i].x2 - rects[i].x1) * cpp;
+
+			for (y = rects[i].y1; y < rects[i].y2; y++)
+				memcpy(dst + (y - crtc->y) * dst_pitch +
+						(rects[i].x1 - crtc->x) * cpp,
+					src + y * src_pitch +
+						rects[i].x1 * cpp,
+					len);
+		}
+		armsoc_bo_cpu_fini(bo, ARMSOC_GEM_WRITE);
+		armsoc_bo_cpu_fini(root, ARMSOC_GEM_READ);
+	}
+
+	RegionUninit(&clip);
+}
+
+static void
+drmmode_crtc_scanout_copy_all(xf86CrtcPtr crtc, struct armsoc_bo *bo)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	RegionRec region;
+	BoxRec box;
+
+	box.x1 = 0;
+	box.y1 = 0;
+	box.x2 = armsoc_bo_width(pARMSOC->scanout);
+	box.y2 = armsoc_bo_height(pARMSOC->scanout);
+	RegionInit(&region, &box, 1);
+	drmmode_crtc_scanout_copy(crtc, bo, &region);
+	RegionUninit(&region);
+}
+
+/**
+ * Show what has been drawn since the last update on the CRTC, by copying
+ * it to the back buffer and flipping to that. If there is no back buffer
+ * or the flip fails, the buffer being scanned out is written to instead.
+ */
+static void
+drmmode_crtc_scanout_flip(xf86CrtcPtr crtc)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct armsoc_bo *back = drmmode_crtc->scanout_back;
+	uint32_t fb_id;
+
+	if (back) {
+		RegionUnion(&drmmode_crtc->scanout_stale,
+				&drmmode_crtc->scanout_stale,
+				&drmmode_crtc->scanout_damage);
+		drmmode_crtc_scanout_copy(crtc, back,
+				&drmmode_crtc->scanout_stale);
+
+		fb_id = armsoc_bo_get_fb(back);
+		if (!drmModePageFlip(drmmode->fd, drmmode_crtc->crtc_id,
+				fb_id, DRM_MODE_PAGE_FLIP_EVENT,
+				(void *)((uintptr_t)crtc |
+						DRMMODE_SCANOUT_FLIP))) {
+			drmmode_crtc->scanout_fb_id = fb_id;
+			drmmode_crtc->scanout_flip_pending = TRUE;
+			/* the buffer being flipped away from is now the
+			 * one behind */
+			RegionCopy(&drmmode_crtc->scanout_stale,
+					&drmmode_crtc->scanout_damage);
+			RegionEmpty(&drmmode_crtc->scanout_damage);
+			return;
+		}
+
+		DEBUG_MSG("crtc %d: scanout flip failed: %s",
+				drmmode_crtc->crtc_id, strerror(errno));
+		RegionEmpty(&drmmode_crtc->scanout_stale);
+	}
+
+	drmmode_crtc_scanout_copy(crtc, drmmode_crtc->scanout,
+			&drmmode_crtc->scanout_damage);
+	RegionEmpty(&drmmode_crtc->scanout_damage);
+}
+
+/* A CRTC has flipped to its back buffer, which becomes its front buffer.
+ * Returns FALSE if the event is not for such a flip. */
+static Bool
+drmmode_crtc_scanout_flipped(void *user_data)
+{
+	xf86CrtcPtr crtc;
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	struct armsoc_bo *bo;
+
+	if (!((uintptr_t)user_data & DRMMODE_SCANOUT_FLIP))
+		return FALSE;
+
+	crtc = (xf86CrtcPtr)((uintptr_t)user_data & ~DRMMODE_SCANOUT_FLIP);
+	drmmode_crtc = crtc->driver_private;
+	bo = drmmode_crtc->scanout;
+	drmmode_crtc->scanout = drmmode_crtc->scanout_back;
+	drmmode_crtc->scanout_back = bo;
+	drmmode_crtc->scanout_flip_pending = FALSE;
+	return TRUE;
+}
+
+/**
+ * Bring the scanout buffers of the CRTCs up to date with what has been
+ * drawn to the root pixmap. Called from the block handler. A CRTC that is
+ * still flipping to the last update gets what was drawn since on a later
+ * call, after the flip has completed.
+ */
+void
+drmmode_update_crtc_scanouts(ScrnInfoPtr pScrn)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	RegionPtr damage = DamageRegion(pARMSOC->scanout_damage);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		/* CRTCs that are off are brought up to date when they are
+		 * turned back on */
+		if (!crtc->enabled || !drmmode_crtc->scanout ||
+		    !drmmode_crtc->scanout_fb_id)
+			continue;
+
+		if (RegionNotEmpty(damage))
+			RegionUnion(&drmmode_crtc->scanout_damage,
+					&drmmode_crtc->scanout_damage, damage);
+		if (!drmmode_crtc->scanout_flip_pending &&
+		    RegionNotEmpty(&drmmode_crtc->scanout_damage))
+			drmmode_crtc_scanout_flip(crtc);
+	}
+
+	DamageEmpty(pARMSOC->scanout_damage);
+}
+
+/* Copy one CRTC's part of the framebuffer the kernel is scanning out into
+ * the scanout buffer, and add the area written to *copied. */
+static Bool
+drmmode_copy_crtc_fb(xf86CrtcPtr crtc, unsigned char *dst, RegionPtr copied)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drm_mode_map_dumb map_dumb;
+	struct drm_gem_close gem_close;
+	drmModeCrtcPtr kcrtc;
+	drmModeFBPtr fb = NULL;
+	unsigned char *src = MAP_FAILED;
+	uint32_t dst_pitch = armsoc_bo_pitch(pARMSOC->scanout);
+	uint32_t cpp = armsoc_bo_bpp(pARMSOC->scanout) / 8;
+	int dst_x = crtc->desiredX, dst_y = crtc->desiredY;
+	int width, height, y;
+	RegionRec region;
+	BoxRec box;
+	Bool ret = FALSE;
+
+	kcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	if (!kcrtc || !kcrtc->buffer_id || !kcrtc->mode_valid)
+		goto out;
+
+	/* only the DRM master gets a handle to another client's buffer */
+	fb = drmModeGetFB(drmmode->fd, kcrtc->buffer_id);
+	if (!fb || !fb->handle)
+		goto out;
+
+	if (fb->bpp != armsoc_bo_bpp(pARMSOC->scanout) ||
+	    fb->depth != armsoc_bo_depth(pARMSOC->scanout)) {
+		INFO_MSG("crtc %d: boot framebuffer format %d/%d doesn't match the screen",
+				drmmode_crtc->crtc_id, fb->depth, fb->bpp);
+		goto close;
+	}
+
+	width = min(kcrtc->width, fb->width - kcrtc->x);
+	width = min(width, (int)armsoc_bo_width(pARMSOC->scanout) - dst_x);
+	height = min(kcrtc->height, fb->height - kcrtc->y);
+	height = min(height, (int)armsoc_bo_height(pARMSOC->scanout) - dst_y);
+	if (width <= 0 || height <= 0)
+		goto close;
+
+	memset(&map_dumb, 0, sizeof(map_dumb));
+	map_dumb.handle = fb->handle;
+	if (drmIoctl(drmmode->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_dumb))
+		goto close;
+
+	src = mmap(NULL, fb->pitch * fb->height, PROT_READ, MAP_SHARED,
+			drmmode->fd, map_dumb.offset);
+	if (src == MAP_FAILED)
+		goto close;
+
+	for (y = 0; y < height; y++)
+		memcpy(dst + (dst_y + y) * dst_pitch + dst_x * cpp,
+				src + (kcrtc->y + y) * fb->pitch +
+				kcrtc->x * cpp,
+				width * cpp);
+
+	munmap(src, fb->pitch * fb->height);
+
+	box.x1 = dst_x;
+	box.y1 = dst_y;
+	box.x2 = dst_x + width;
+	box.y2 = dst_y + height;
+	RegionInit(&region, &box, 1);
+	RegionUnion(copied, copied, &region);
+	RegionUninit(&region);
+
+	DEBUG_MSG("crtc %d: copied %dx%d of boot framebuffer %d",
+			drmmode_crtc->crtc_id, width, height, fb->fb_id);
+	ret = TRUE;
+
+close:
+	memset(&gem_close, 0, sizeof(gem_close));
+	gem_close.handle = fb->handle;
+	drmIoctl(drmmode->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+out:
+	if (fb)
+		drmModeFreeFB(fb);
+	if (kcrtc)
+		drmModeFreeCrtc(kcrtc);
+	return ret;
+}
+
+/**
+ * Initialize the scanout buffer with what the CRTCs are showing when the
+ * server starts, such as a boot splash, read straight from the kernel's
+ * framebuffers. Each CRTC's picture is put where that CRTC will show the
+ * screen, and the rest of the buffer is cleared. Together with the mode
+ * being kept if it matches, this hands the display over without a flash.
+ * Returns FALSE if no CRTC could be copied.
+ */
+Bool
+drmmode_copy_boot_fb(ScrnInfoPtr pScrn)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	uint32_t dst_pitch = armsoc_bo_pitch(pARMSOC->scanout);
+	uint32_t cpp = armsoc_bo_bpp(pARMSOC->scanout) / 8;
+	unsigned char *dst;
+	RegionRec copied, rest;
+	BoxRec box;
+	BoxPtr rects;
+	int i, n, y, num_copied = 0;
+
+	dst = armsoc_bo_map(pARMSOC->scanout);
+	if (!dst) {
+		ERROR_MSG("Couldn't map scanout bo");
+		return FALSE;
+	}
+
+	RegionNull(&copied);
+	armsoc_bo_cpu_prep(pARMSOC->scanout, ARMSOC_GEM_WRITE);
+
+	for (i = 0; i < config->num_crtc; i++)
+		if (config->crtc[i]->enabled &&
+		    drmmode_copy_crtc_fb(config->crtc[i], dst, &copied))
+			num_copied++;
+
+	if (num_copied) {
+		box.x1 = 0;
+		box.y1 = 0;
+		box.x2 = armsoc_bo_width(pARMSOC->scanout);
+		box.y2 = armsoc_bo_height(pARMSOC->scanout);
+		RegionInit(&rest, &box, 1);
+		RegionSubtract(&rest, &rest, &copied);
+		rects = RegionRects(&rest);
+		for (n = 0; n < RegionNumRects(&rest); n++)
+			for (y = rects[n].y1; y < rects[n].y2; y++)
+				memset(dst + y * dst_pitch + rects[n].x1 * cpp,
+						0, (rects[n].x2 - rects[n].x1) * cpp);
+		RegionUninit(&rest);
+	}
+
+	armsoc_bo_cpu_fini(pARMSOC->scanout, ARMSOC_GEM_WRITE);
+	RegionUninit(&copied);
+
+	return num_copied > 0;
+}
+
+/**
+ * The size to allocate the scanout buffer at so that it can be resized in
+ * place to any mode of the connected outputs, in either orientation:
+ * a square as big as the largest side of any of their modes, within what
+ * the display controller can scan out.
+ */
+void
+drmmode_scanout_capacity(ScrnInfoPtr pScrn, int *width, int *height)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	DisplayModePtr mode;
+	int i, side = 0;
+
+	for (i = 0; i < config->num_output; i++) {
+		xf86OutputPtr output = config->output[i];
+
+		if (output->status != XF86OutputStatusConnected)
+			continue;
+
+		for (mode = output->probed_modes; mode; mode = mode->next)
+			side = max(side, max(mode->HDisplay, mode->VDisplay));
+	}
+
+	*width = max(pScrn->virtualX, min(side, drmmode->mode_res->max_width));
+	*height = max(pScrn->virtualY,
+			min(side, drmmode->mode_res->max_height));
+}
+
+static int
+drmmode_revert_mode(xf86CrtcPtr crtc, uint32_t *output_ids, int output_count)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	uint32_t fb_id;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	drmModeModeInfo kmode;
+
+	if (!drmmode_crtc->last_good_mode) {
+		DEBUG_MSG("No last good values to use");
+		return FALSE;
+	}
+
+	/* revert to last good settings */
+	DEBUG_MSG("Reverting to last_good values");
+	if (!resize_scanout_bo(pScrn,
+			drmmode_crtc->last_good_mode->HDisplay,
+			drmmode_crtc->last_good_mode->VDisplay)) {
+		ERROR_MSG("Could not revert to last good mode");
+		return FALSE;
+	}
+
+	drmmode_ConvertToKMode(crtc->scrn, &kmode,
+			drmmode_crtc->last_good_mode);
+	if (pARMSOC->PerCrtcScanout) {
+		struct armsoc_bo *bo = drmmode_crtc_scanout_get(crtc,
+				drmmode_crtc->last_good_mode);
+
+		if (!bo)
+			return FALSE;
+
+		crtc->x = drmmode_crtc->last_good_x;
+		crtc->y = drmmode_crtc->last_good_y;
+		drmmode_crtc_scanout_copy_all(crtc, bo);
+		if (!drmmode_crtc_program(crtc, armsoc_bo_get_fb(bo), 0, 0,
+				output_ids, output_count, &kmode))
+			drmmode_crtc_scanout_set(crtc, bo);
+		armsoc_bo_unreference(bo);
+	} else {
+		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+		drmmode_crtc_program(crtc, fb_id,
+				drmmode_crtc->last_good_x,
+				drmmode_crtc->last_good_y,
+				output_ids, output_count, &kmode);
+	}
+
+	drmmode_retire_fb(pScrn);
+
+	/* let RandR know we changed things */
+	xf86RandR12TellChanged(pScrn->pScreen);
+
+	return TRUE;
+}
+
+/* How a CRTC's current hardware state differs from what we want to set */
+enum drmmode_crtc_state {
+	DRMMODE_STATE_DIFFERENT,	/* needs a modeset */
+	DRMMODE_STATE_FB,		/* only the framebuffer differs */
+	DRMMODE_STATE_SAME,		/* nothing to do */
+};
+
+static Bool
+drmmode_kmode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay &&
+		a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end &&
+		a->htotal == b->htotal &&
+		a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay &&
+		a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end &&
+		a->vtotal == b->vtotal &&
+		a->vscan == b->vscan &&
+		a->flags == b->flags;
+}
+
+/**
+ * Compare the kernel's state of a CRTC, read with drmModeGetCrtc(), with
+ * the mode, framebuffer position and outputs we are about to program, so
+ * that VT switches and screen resizes which don't change the display
+ * don't blank it with a modeset.
+ */
+static enum drmmode_crtc_state
+drmmode_crtc_compare(xf86CrtcPtr crtc, drmModeCrtcPtr cur, uint32_t fb_id,
+		int x, int y, drmModeModeInfo *kmode)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	uint32_t *driving;
+	int num_driving = 0, output_count = 0;
+	int i, j, k;
+	Bool found;
+
+	if (!cur->mode_valid || cur->x != (uint32_t)x || cur->y != (uint32_t)y ||
+	    !drmmode_kmode_equal(&cur->mode, kmode))
+		return DRMMODE_STATE_DIFFERENT;
+
+#ifdef DRM_CLIENT_CAP_ATOMIC
+	/* an atomic CRTC that is switched off keeps its mode */
+	if (drmmode->atomic) {
+		uint64_t active = 0;
+
+		drmmode_prop_value(drmmode->fd, drmmode_crtc->crtc_id,
+				DRM_MODE_OBJECT_CRTC, drmmode_crtc->prop_active,
+				&active);
+		if (!active)
+			return DRMMODE_STATE_DIFFERENT;
+	}
+#endif
+
+	/* The encoders driving the CRTC must be those of our outputs */
+	driving = calloc(drmmode->mode_res->count_encoders, sizeof(*driving));
+	if (!driving)
+		return DRMMODE_STATE_DIFFERENT;
+
+	for (i = 0; i < drmmode->mode_res->count_encoders; i++) {
+		drmModeEncoderPtr encoder = drmModeGetEncoder(drmmode->fd,
+				drmmode->mode_res->encoders[i]);
+
+		if (!encoder)
+			continue;
+		if (encoder->crtc_id == drmmode_crtc->crtc_id)
+			driving[num_driving++] = encoder->encoder_id;
+		drmModeFreeEncoder(encoder);
+	}
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output =
+				output->driver_private;
+
+		if (output->crtc != crtc)
+			continue;
+
+		output_count++;
+		found = FALSE;
+		for (j = 0; j < drmmode_output->connector->count_encoders; j++)
+			for (k = 0; k < num_driving; k++)
+				if (drmmode_output->encoders[j]->encoder_id ==
+						driving[k])
+					found = TRUE;
+		if (!found) {
+			free(driving);
+			return DRMMODE_STATE_DIFFERENT;
+		}
+	}
+	free(driving);
+
+	if (num_driving != output_count)
+		return DRMMODE_STATE_DIFFERENT;
+
+	return cur->buffer_id == fb_id ? DRMMODE_STATE_SAME : DRMMODE_STATE_FB;
+}
+
+static Bool
+drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
+		Rotation rotation, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	uint32_t *output_ids = NULL;
+	int output_count = 0;
+	int ret = TRUE;
+	int err;
+	int i;
+	uint32_t fb_id;
+	int fb_x = x, fb_y = y;
+	struct armsoc_bo *crtc_scanout = NULL;
+	drmModeModeInfo kmode;
+	drmModeCrtcPtr cur = NULL, newcrtc = NULL;
+	enum drmmode_crtc_state state;
+
+	TRACE_ENTER();
+
+	pARMSOC->crtc_config_serial++;
+
+	if (pARMSOC->PerCrtcScanout) {
+		drmmode_crtc_scanout_wait(crtc);
+		crtc_scanout = drmmode_crtc_scanout_get(crtc, mode);
+		if (!crtc_scanout)
+			return FALSE;
+
+		fb_id = armsoc_bo_get_fb(crtc_scanout);
+		fb_x = 0;
+		fb_y = 0;
+	} else {
+		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	}
+
+	if (fb_id == 0) {
+		DEBUG_MSG("create framebuffer: %dx%d",
+				pScrn->virtualX, pScrn->virtualY);
+
+		err = armsoc_bo_add_fb(pARMSOC->scanout);
+		if (err) {
+			ERROR_MSG(
+					"Failed to add framebuffer to the scanout buffer");
+			return FALSE;
+		}
+
+		fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+		if (0 == fb_id)
+			return FALSE;
+	}
+
+	/* Set the new mode: */
+	crtc->mode = *mode;
+	crtc->x = x;
+	crtc->y = y;
+	crtc->rotation = rotation;
+
+	output_ids = calloc(xf86_config->num_output, sizeof *output_ids);
+	if (!output_ids) {
+		ERROR_MSG(
+				"memory allocation failed in drmmode_set_mode_major()");
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		struct drmmode_output_priv *drmmode_output;
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output = output->driver_private;
+		output_ids[output_count] =
+				drmmode_output->connector->connector_id;
+		output_count++;
+	}
+
+	drmmode_ConvertToKMode(crtc->scrn, &kmode, mode);
+
+	/* With atomic modesetting, have the kernel check the configuration
+	 * before anything is changed, so one it can't do leaves the display
+	 * as it was and there is nothing to revert */
+	if (drmmode->atomic) {
+		err = drmmode_crtc_atomic_set(crtc, fb_id, fb_x, fb_y, &kmode,
+				TRUE);
+		if (err) {
+			ERROR_MSG("drm rejected mode: %s", strerror(-err));
+			ret = FALSE;
+			goto cleanup;
+		}
+	}
+
+	if (!xf86CrtcRotate(crtc)) {
+		ERROR_MSG(
+				"failed to assign rotation in drmmode_set_mode_major()");
+		ret = FALSE;
+		goto cleanup;
+	}
+
+	if (crtc->funcs->gamma_set)
+		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
+				       crtc->gamma_blue, crtc->gamma_size);
+
+	if (crtc_scanout)
+		drmmode_crtc_scanout_copy_all(crtc, crtc_scanout);
+
+	/* Leave the CRTC alone if it already shows what we want, and only
+	 * swap the buffer if nothing else changes */
+	cur = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	state = cur ? drmmode_crtc_compare(crtc, cur, fb_id, fb_x, fb_y,
+			&kmode) : DRMMODE_STATE_DIFFERENT;
+	if (state == DRMMODE_STATE_FB) {
+		/* Both take effect before they return, so nothing is left
+		 * pending to make the next flip on the CRTC fail with EBUSY.
+		 * Kernels with atomic helpers handle a SetCrtc with the mode
+		 * unchanged as a plane update, not a modeset. */
+		if (drmmode->atomic)
+			err = drmmode_crtc_atomic_pan(crtc, fb_id, fb_x, fb_y);
+		else
+			err = drmModeSetCrtc(drmmode->fd,
+					drmmode_crtc->crtc_id, fb_id,
+					fb_x, fb_y, output_ids, output_count,
+					&kmode);
+		if (err)
+			state = DRMMODE_STATE_DIFFERENT;
+		else
+			cur->buffer_id = fb_id;
+	}
+
+	if (state != DRMMODE_STATE_DIFFERENT) {
+		DEBUG_MSG("crtc %d: %s", drmmode_crtc->crtc_id,
+				state == DRMMODE_STATE_SAME ?
+				"mode already set" : "flipped to new framebuffer");
+		newcrtc = cur;
+		cur = NULL;
+		if (crtc_scanout)
+			drmmode_crtc_scanout_set(crtc, crtc_scanout);
+		goto check_mode;
+	}
+
+	err = drmmode_crtc_program(crtc, fb_id, fb_x, fb_y,
+			output_ids, output_count, &kmode);
+	if (err) {
+		ERROR_MSG(
+				"drm failed to set mode: %s", strerror(-err));
+
+		ret = FALSE;
+		/* a failed atomic commit has changed nothing */
+		if (drmmode->atomic ||
+		    !drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+	if (crtc_scanout)
+		drmmode_crtc_scanout_set(crtc, crtc_scanout);
+
+	/* an atomic commit that succeeded set exactly what was asked */
+	if (drmmode->atomic)
+		goto save_mode;
+
+	/* get the actual crtc info */
+	newcrtc = drmModeGetCrtc(drmmode->fd, drmmode_crtc->crtc_id);
+	if (!newcrtc) {
+		ERROR_MSG("couldn't get actual mode back");
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+check_mode:
+	if (kmode.hdisplay != newcrtc->mode.hdisplay ||
+		kmode.vdisplay != newcrtc->mode.vdisplay) {
+
+		ERROR_MSG(
+			"drm did not set requested mode! (requested %dx%d, actual %dx%d)",
+			kmode.hdisplay, kmode.vdisplay,
+			newcrtc->mode.hdisplay,
+			newcrtc->mode.vdisplay);
+
+		ret = FALSE;
+		if (!drmmode_revert_mode(crtc, output_ids, output_count))
+			goto cleanup;
+		else
+			goto done_setting;
+	}
+
+save_mode:
+	/* When called on a resize, crtc->mode already contains the
+	 * resized values so we can't use this for recovery.
+	 * We can't read it out of the crtc either as mode_valid is 0.
+	 * Instead we save the last good mode set here & fallback to
+	 * that on failure.
+	 */
+	DEBUG_MSG("Saving last good values");
+	drmmode_crtc->last_good_x = crtc->x;
+	drmmode_crtc->last_good_y = crtc->y;
+	drmmode_crtc->last_good_rotation = crtc->rotation;
+	if (drmmode_crtc->last_good_mode) {
+		if (drmmode_crtc->last_good_mode->name)
+			free((void *)drmmode_crtc->last_good_mode->name);
+		free(drmmode_crtc->last_good_mode);
+	}
+	drmmode_crtc->last_good_mode = xf86DuplicateMode(&crtc->mode);
+
+	ret = TRUE;
+
+done_setting:
+	if (pARMSOC->PerCrtcScanout)
+		drmmode_crtc->scanout_fb_id = drmmode_crtc->scanout ?
+				armsoc_bo_get_fb(drmmode_crtc->scanout) : 0;
+	else
+		drmmode_crtc->scanout_fb_id =
+				armsoc_bo_get_fb(pARMSOC->scanout);
+
+	/* Turn on any outputs on this crtc that may have been disabled: */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output_dpms(output, DPMSModeOn);
+	}
+
+	/* if hw cursor is initialized, reload it */
+	if (drmmode->cursor)
+		xf86_reload_cursors(pScrn->pScreen);
+
+	drmmode_vblank_probe(pScrn);
+
+cleanup:
+	if (cur)
+		drmModeFreeCrtc(cur);
+
+	if (newcrtc)
+		drmModeFreeCrtc(newcrtc);
+
+	if (crtc_scanout)
+		armsoc_bo_unreference(crtc_scanout);
+
+	if (output_ids)
+		free(output_ids);
+
+	if (!ret && drmmode_crtc->last_good_mode) {
+		/* If there was a problem, restore the last good mode: */
+		crtc->x = drmmode_crtc->last_good_x;
+		crtc->y = drmmode_crtc->last_good_y;
+		crtc->rotation = drmmode_crtc->last_good_rotation;
+		crtc->mode = *drmmode_crtc->last_good_mode;
+	}
+
+	TRACE_EXIT();
+	return ret;
+}
+
+static void
+drmmode_hide_cursor(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+
+	if (!cursor)
+		return;
 
 	drmmode_crtc->cursor_visible = FALSE;
 
+	drmmode_crtc->cursor_move_pending = FALSE;
+
 	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
+		/* a shared plane may have moved on to another CRTC */
+		if (cursor->ovr &&
+		    cursor->plane_crtc_id != drmmode_crtc->crtc_id)
+			return;
+
 		/* set plane's fb_id to 0 to disable it */
-		drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
+		drmModeSetPlane(drmmode->fd,
+				drmmode_crtc->cursor_plane->plane_id,
 				drmmode_crtc->crtc_id, 0, 0,
 				0, 0, 0, 0, 0, 0, 0, 0);
+		cursor->plane_crtc_id = 0;
 	} else { /* HWCURSOR_API_STANDARD */
 		/* set handle to 0 to disable the cursor */
 		drmModeSetCursor(drmmode->fd, drmmode_crtc->crtc_id,
@@ -461,6 +1820,43 @@ drmmode_hide_cursor(xf86CrtcPtr crtc)
  * which doesn't allow changing the cursor position without updating
  * the image too.
  */
+/* Where the cursor plane goes on the CRTC: the padded cursor at its
+ * position, clipped to the mode, and the part of the image shown */
+static void
+drmmode_cursor_plane_rect(xf86CrtcPtr crtc, int *crtc_x, int *crtc_y,
+		int *w, int *h, int *src_x, int *src_y)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	int pad = pARMSOC->drmmode_interface->cursor_padding;
+
+	*w = pARMSOC->drmmode_interface->cursor_width + 2 * pad;
+	*h = pARMSOC->drmmode_interface->cursor_height;
+	*crtc_x = drmmode_crtc->cursor_x - pad;
+	*crtc_y = drmmode_crtc->cursor_y;
+	*src_x = 0;
+	*src_y = 0;
+
+	/* calculate clipped x, y, w & h if cursor is off edges */
+	if (*crtc_x < 0) {
+		*src_x += -*crtc_x;
+		*w -= -*crtc_x;
+		*crtc_x = 0;
+	}
+
+	if (*crtc_y < 0) {
+		*src_y += -*crtc_y;
+		*h -= -*crtc_y;
+		*crtc_y = 0;
+	}
+
+	if ((*crtc_x + *w) > crtc->mode.HDisplay)
+		*w = crtc->mode.HDisplay - *crtc_x;
+
+	if ((*crtc_y + *h) > crtc->mode.VDisplay)
+		*h = crtc->mode.VDisplay - *crtc_y;
+}
+
 static void
 drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
 {
@@ -476,6 +1872,8 @@ drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
 		return;
 
 	drmmode_crtc->cursor_visible = TRUE;
+	drmmode_crtc->cursor_move_pending = FALSE;
+	drmmode_crtc->cursor_update_usec = drmmode_monotonic_usec();
 
 	w = pARMSOC->drmmode_interface->cursor_width;
 	h = pARMSOC->drmmode_interface->cursor_height;
@@ -484,140 +1882,480 @@ drmmode_show_cursor_image(xf86CrtcPtr crtc, Bool update_image)
 	/* get padded width */
 	w = w + 2 * pad;
 	/* get x of padded cursor */
-	crtc_x = cursor->x - pad;
-	crtc_y = cursor->y;
+	crtc_x = drmmode_crtc->cursor_x - pad;
+	crtc_y = drmmode_crtc->cursor_y;
+
+	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
+		drmmode_cursor_plane_rect(crtc, &crtc_x, &crtc_y, &w, &h,
+				&src_x, &src_y);
+
+		/* note src coords (last 4 args) are in Q16 format */
+		drmModeSetPlane(drmmode->fd,
+			drmmode_crtc->cursor_plane->plane_id,
+			drmmode_crtc->crtc_id, cursor->fb_id, 0,
+			crtc_x, crtc_y, w, h, src_x<<16, src_y<<16,
+			w<<16, h<<16);
+		cursor->plane_crtc_id = drmmode_crtc->crtc_id;
+	} else {
+		if (update_image)
+			drmModeSetCursor(drmmode->fd,
+					 drmmode_crtc->crtc_id,
+					 cursor->handle, w, h);
+		drmModeMoveCursor(drmmode->fd,
+				  drmmode_crtc->crtc_id,
+				  crtc_x, crtc_y);
+	}
+}
+
+static void
+drmmode_show_cursor(xf86CrtcPtr crtc)
+{
+	drmmode_show_cursor_image(crtc, TRUE);
+}
+
+/* Shortest time between two cursor moves sent to the kernel */
+static uint32_t
+drmmode_cursor_move_period(xf86CrtcPtr crtc)
+{
+	uint32_t period = drmmode_mode_frame_period(&crtc->mode);
+
+	return period ? period : ARMSOC_SOFT_VBLANK_PERIOD;
+}
+
+/*
+ * Sends the moves held back whose frame has passed. Timers run with the
+ * input lock held, so this doesn't race with moves from the input thread.
+ */
+static CARD32
+drmmode_cursor_move_timer(OsTimerPtr timer, CARD32 time, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	uint64_t now = drmmode_monotonic_usec();
+	uint64_t deadline, next = 0;
+	int i;
+
+	if (!cursor)
+		return 0;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+
+		if (!drmmode_crtc->cursor_move_pending)
+			continue;
+
+		deadline = drmmode_crtc->cursor_update_usec +
+				drmmode_cursor_move_period(crtc);
+		if (deadline <= now) {
+			drmmode_show_cursor_image(crtc, FALSE);
+			continue;
+		}
+		if (!next || deadline < next)
+			next = deadline;
+	}
+
+	cursor->move_deadline = next;
+	/* in milliseconds, rounded up so we don't wake up too early */
+	return next ? max((next - now + 999) / 1000, 1) : 0;
+}
+
+static void
+drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	uint64_t now, deadline;
+
+	if (!cursor)
+		return;
+
+	drmmode_crtc->cursor_x = x;
+	drmmode_crtc->cursor_y = y;
+
+	/* a hidden cursor is put in place when it is shown */
+	if (!drmmode_crtc->cursor_visible)
+		return;
+
+	/*
+	 * Pointers report motion far more often than the display refreshes
+	 * and only the last position of each frame is ever seen, so send at
+	 * most one move per frame and hold back the rest. Show the cursor
+	 * at a different position without updating the image when possible
+	 * (HWCURSOR_API_PLANE doesn't have a way to update cursor position
+	 * without updating the image too).
+	 */
+	now = drmmode_monotonic_usec();
+	deadline = drmmode_crtc->cursor_update_usec +
+			drmmode_cursor_move_period(crtc);
+	if (now >= deadline) {
+		drmmode_show_cursor_image(crtc, FALSE);
+		return;
+	}
+
+	if (drmmode_crtc->cursor_move_pending)
+		return;
+	drmmode_crtc->cursor_move_pending = TRUE;
+
+	/* Only ever bring the timer forward; when it fires it works out
+	 * the next wakeup for the CRTCs still waiting. The timer exists
+	 * already, so this only re-arms it.
+	 */
+	if (!cursor->move_deadline || deadline < cursor->move_deadline) {
+		cursor->move_deadline = deadline;
+		TimerSet(cursor->move_timer, 0,
+				max((deadline - now + 999) / 1000, 1),
+				drmmode_cursor_move_timer, crtc->scrn);
+	}
+}
+
+/*
+ * The cursor format is ARGB so the image can be copied straight over.
+ * Columns of CURSORPAD blank pixels are maintained down either side
+ * of the destination image. This is a workaround for a bug causing
+ * corruption when the cursor reaches the screen edges in some DRM
+ * drivers.
+ */
+static void set_cursor_image(xf86CrtcPtr crtc, uint32_t *d, CARD32 *s)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	int row;
+	void *dst;
+	const char *src_row;
+	char *dst_row;
+	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
+	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
+	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
+
+	dst = d;
+	for (row = 0; row < cursorh; row += 1) {
+		/* we're operating with ARGB data (4 bytes per pixel) */
+		src_row = (const char *)s + row * 4 * cursorw;
+		dst_row = (char *)dst + row * 4 * (cursorw + 2 * cursorpad);
+
+		/* set first CURSORPAD pixels in row to 0 */
+		memset(dst_row, 0, (4 * cursorpad));
+		/* copy cursor image pixel row across */
+		memcpy(dst_row + (4 * cursorpad), src_row, 4 * cursorw);
+		/* set last CURSORPAD pixels in row to 0 */
+		memset(dst_row + 4 * (cursorpad + cursorw),
+				0, (4 * cursorpad));
+	}
+}
+
+/* Give a cursor cache entry a buffer, and a framebuffer for the plane API */
+static Bool
+drmmode_cursor_image_alloc(ScrnInfoPtr pScrn, struct drmmode_cursor_image *entry)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	uint32_t handles[4], pitches[4], offsets[4]; /* we only use [0] */
+	int w, h, pad;
+
+	w = pARMSOC->drmmode_interface->cursor_width;
+	h = pARMSOC->drmmode_interface->cursor_height;
+	pad = pARMSOC->drmmode_interface->cursor_padding;
+
+	entry->argb = malloc(w * h * sizeof(CARD32));
+	if (!entry->argb)
+		return FALSE;
+
+	/* allow for cursor padding in the bo */
+	entry->bo = armsoc_bo_new_with_dim(pARMSOC->dev,
+				w + 2 * pad, h,
+				0, 32, ARMSOC_BO_SCANOUT);
+	if (!entry->bo) {
+		ERROR_MSG("HW cursor: buffer allocation failed");
+		goto fail;
+	}
 
 	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE) {
-		src_x = 0;
-		src_y = 0;
-
-		/* calculate clipped x, y, w & h if cursor is off edges */
-		if (crtc_x < 0) {
-			src_x += -crtc_x;
-			w -= -crtc_x;
-			crtc_x = 0;
+		handles[0] = armsoc_bo_handle(entry->bo);
+		pitches[0] = armsoc_bo_pitch(entry->bo);
+		offsets[0] = 0;
+
+		/* allow for cursor padding in the fb */
+		if (drmModeAddFB2(drmmode->fd, w + 2 * pad, h,
+				DRM_FORMAT_ARGB8888, handles, pitches, offsets,
+				&entry->fb_id, 0)) {
+			ERROR_MSG("HW cursor: drmModeAddFB2 failed: %s",
+					strerror(errno));
+			armsoc_bo_unreference(entry->bo);
+			entry->bo = NULL;
+			goto fail;
+		}
+	}
+
+	/* nothing matches an entry until an image is loaded into it */
+	entry->hash = 0;
+	memset(entry->argb, 0, w * h * sizeof(CARD32));
+	entry->last_used = 0;
+	return TRUE;
+
+fail:
+	free(entry->argb);
+	entry->argb = NULL;
+	return FALSE;
+}
+
+static void
+drmmode_cursor_image_free(ScrnInfoPtr pScrn, struct drmmode_cursor_image *entry)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+
+	if (entry->fb_id)
+		drmModeRmFB(drmmode->fd, entry->fb_id);
+	if (entry->bo)
+		armsoc_bo_unreference(entry->bo);
+	free(entry->argb);
+	memset(entry, 0, sizeof(*entry));
+}
+
+/* Make an entry of the cache the one the hardware shows */
+static void
+drmmode_cursor_use_image(struct drmmode_cursor_rec *cursor, int index)
+{
+	struct drmmode_cursor_image *entry = &cursor->images[index];
+
+	cursor->current = index;
+	cursor->bo = entry->bo;
+	cursor->fb_id = entry->fb_id;
+	cursor->handle = armsoc_bo_handle(entry->bo);
+	entry->last_used = ++cursor->use_count;
+}
+
+static uint32_t
+drmmode_cursor_hash(const CARD32 *image, int n)
+{
+	uint32_t hash = 2166136261u;	/* FNV-1a */
+	int i;
+
+	for (i = 0; i < n; i++)
+		hash = (hash ^ image[i]) * 16777619u;
+	return hash;
+}
+
+/*
+ * Cursor images are kept in a small cache of buffers. An image seen before
+ * is shown by pointing the hardware at its buffer; a new one is written to
+ * a buffer that isn't being shown and then swapped in, so the cursor never
+ * has to be hidden while its image is rewritten.
+ */
+static void
+drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+{
+	uint32_t *d;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	struct drmmode_cursor_rec *cursor = drmmode->cursor;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_cursor_image *entry;
+	int n, i, victim = -1;
+	uint32_t hash;
+	Bool visible;
+
+	if (!cursor)
+		return;
+
+	visible = drmmode_crtc->cursor_visible;
+
+	n = pARMSOC->drmmode_interface->cursor_width *
+		pARMSOC->drmmode_interface->cursor_height;
+	hash = drmmode_cursor_hash(image, n);
+
+	for (i = 0; i < ARMSOC_CURSOR_CACHE_SIZE; i++) {
+		entry = &cursor->images[i];
+		if (entry->bo && entry->hash == hash &&
+		    !memcmp(entry->argb, image, n * sizeof(CARD32)))
+			break;
+	}
+
+	if (i == ARMSOC_CURSOR_CACHE_SIZE) {
+		/* Load into the least recently used entry, other than the
+		 * one on screen */
+		for (i = 0; i < ARMSOC_CURSOR_CACHE_SIZE; i++) {
+			if (i == cursor->current)
+				continue;
+			if (!cursor->images[i].bo) {
+				if (!drmmode_cursor_image_alloc(pScrn,
+						&cursor->images[i]))
+					continue;
+				victim = i;
+				break;
+			}
+			if (victim < 0 || cursor->images[i].last_used <
+					cursor->images[victim].last_used)
+				victim = i;
 		}
 
-		if (crtc_y < 0) {
-			src_y += -crtc_y;
-			h -= -crtc_y;
-			crtc_y = 0;
-		}
+		/* out of memory: rewrite the image on screen */
+		if (victim < 0)
+			victim = cursor->current;
 
-		if ((crtc_x + w) > crtc->mode.HDisplay)
-			w = crtc->mode.HDisplay - crtc_x;
+		entry = &cursor->images[victim];
+		d = armsoc_bo_map(entry->bo);
+		if (!d) {
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+				"load_cursor_argb map failure\n");
+			return;
+		}
 
-		if ((crtc_y + h) > crtc->mode.VDisplay)
-			h = crtc->mode.VDisplay - crtc_y;
+		if (victim == cursor->current && drmmode_crtc->cursor_visible)
+			drmmode_hide_cursor(crtc);
 
-		/* note src coords (last 4 args) are in Q16 format */
-		drmModeSetPlane(drmmode->fd, cursor->ovr->plane_id,
-			drmmode_crtc->crtc_id, cursor->fb_id, 0,
-			crtc_x, crtc_y, w, h, src_x<<16, src_y<<16,
-			w<<16, h<<16);
-	} else {
-		if (update_image)
-			drmModeSetCursor(drmmode->fd,
-					 drmmode_crtc->crtc_id,
-					 cursor->handle, w, h);
-		drmModeMoveCursor(drmmode->fd,
-				  drmmode_crtc->crtc_id,
-				  crtc_x, crtc_y);
+		set_cursor_image(crtc, d, image);
+		memcpy(entry->argb, image, n * sizeof(CARD32));
+		entry->hash = hash;
+		i = victim;
 	}
+
+	drmmode_cursor_use_image(cursor, i);
+
+	/* each CRTC showing the cursor is pointed at the new buffer by its
+	 * own call */
+	if (visible)
+		drmmode_show_cursor_image(crtc, TRUE);
 }
 
-static void
-drmmode_show_cursor(xf86CrtcPtr crtc)
+/* How well a plane suits the cursor: 2 for a cursor plane, 1 for an
+ * overlay, 0 if it can't be used (a primary plane) */
+static int
+drmmode_cursor_plane_rank(ScrnInfoPtr pScrn, drmModePlanePtr plane)
 {
-	drmmode_show_cursor_image(crtc, TRUE);
+#ifdef DRM_CLIENT_CAP_UNIVERSAL_PLANES
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+	drmmode_prop_lookup(drmmode->fd, plane->plane_id,
+			DRM_MODE_OBJECT_PLANE, "type", &type);
+	if (type == DRM_PLANE_TYPE_CURSOR)
+		return 2;
+	if (type == DRM_PLANE_TYPE_PRIMARY)
+		return 0;
+#endif
+	return drmmode_plane_is_primary(pScrn, plane->plane_id) ? 0 : 1;
 }
 
 static void
-drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+drmmode_cursor_free_planes(ScrnInfoPtr pScrn, struct drmmode_cursor_rec *cursor)
 {
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-
-	if (!cursor)
-		return;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-	cursor->x = x;
-	cursor->y = y;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->cursor_plane &&
+		    drmmode_crtc->cursor_plane != cursor->ovr)
+			drmModeFreePlane(drmmode_crtc->cursor_plane);
+		drmmode_crtc->cursor_plane = NULL;
+		memset(drmmode_crtc->cursor_plane_props, 0,
+				sizeof(drmmode_crtc->cursor_plane_props));
+	}
 
-	/*
-	 * Show the cursor at a different position without updating the image
-	 * when possible (HWCURSOR_API_PLANE doesn't have a way to update
-	 * cursor position without updating the image too).
-	 */
-	drmmode_show_cursor_image(crtc, FALSE);
+	if (cursor->ovr)
+		drmModeFreePlane(cursor->ovr);
+	cursor->ovr = NULL;
 }
 
-/*
- * The cursor format is ARGB so the image can be copied straight over.
- * Columns of CURSORPAD blank pixels are maintained down either side
- * of the destination image. This is a workaround for a bug causing
- * corruption when the cursor reaches the screen edges in some DRM
- * drivers.
+/**
+ * Give each CRTC a plane of its own for the cursor, preferring cursor
+ * planes over overlays, so that moving the cursor between heads is just
+ * a matter of showing one plane and hiding another. If there aren't
+ * enough, fall back to one plane moved to whichever CRTC shows the
+ * cursor. Returns FALSE if there is no plane to use at all.
  */
-static void set_cursor_image(xf86CrtcPtr crtc, uint32_t *d, CARD32 *s)
+static Bool
+drmmode_cursor_pick_planes(ScrnInfoPtr pScrn, struct drmmode_cursor_rec *cursor,
+		drmModePlaneResPtr plane_resources)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
-	int row;
-	void *dst;
-	const char *src_row;
-	char *dst_row;
-	uint32_t cursorh = pARMSOC->drmmode_interface->cursor_height;
-	uint32_t cursorw = pARMSOC->drmmode_interface->cursor_width;
-	uint32_t cursorpad = pARMSOC->drmmode_interface->cursor_padding;
-
-	dst = d;
-	for (row = 0; row < cursorh; row += 1) {
-		/* we're operating with ARGB data (4 bytes per pixel) */
-		src_row = (const char *)s + row * 4 * cursorw;
-		dst_row = (char *)dst + row * 4 * (cursorw + 2 * cursorpad);
-
-		/* set first CURSORPAD pixels in row to 0 */
-		memset(dst_row, 0, (4 * cursorpad));
-		/* copy cursor image pixel row across */
-		memcpy(dst_row + (4 * cursorpad), src_row, 4 * cursorw);
-		/* set last CURSORPAD pixels in row to 0 */
-		memset(dst_row + 4 * (cursorpad + cursorw),
-				0, (4 * cursorpad));
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int count = plane_resources->count_planes;
+	drmModePlanePtr *planes;
+	int *rank;
+	Bool *used;
+	int i, j, best, shared = -1, num_assigned = 0;
+
+	planes = calloc(count, sizeof(*planes));
+	rank = calloc(count, sizeof(*rank));
+	used = calloc(count, sizeof(*used));
+	if (!planes || !rank || !used) {
+		free(planes);
+		free(rank);
+		free(used);
+		return FALSE;
 	}
-}
 
-static void
-drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
-{
-	uint32_t *d;
-	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
-	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
-	struct drmmode_cursor_rec *cursor = drmmode->cursor;
-	int visible;
+	for (j = 0; j < count; j++) {
+		planes[j] = drmModeGetPlane(drmmode->fd,
+				plane_resources->planes[j]);
+		if (planes[j])
+			rank[j] = drmmode_cursor_plane_rank(pScrn, planes[j]);
+		if (rank[j] && shared < 0)
+			shared = j;
+	}
 
-	if (!cursor)
-		return;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		best = -1;
+		for (j = 0; j < count; j++) {
+			if (used[j] || !rank[j] ||
+			    !(planes[j]->possible_crtcs &
+					(1 << drmmode_crtc->pipe)))
+				continue;
+			if (best < 0 || rank[j] > rank[best])
+				best = j;
+		}
+		if (best < 0)
+			break;
 
-	visible = drmmode_crtc->cursor_visible;
+		used[best] = TRUE;
+		drmmode_crtc->cursor_plane = planes[best];
+		num_assigned++;
+	}
 
-	if (visible)
-		drmmode_hide_cursor(crtc);
+	if (num_assigned < xf86_config->num_crtc) {
+		for (i = 0; i < xf86_config->num_crtc; i++) {
+			struct drmmode_crtc_private_rec *drmmode_crtc =
+					xf86_config->crtc[i]->driver_private;
 
-	d = armsoc_bo_map(cursor->bo);
-	if (!d) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-			"load_cursor_argb map failure\n");
-		if (visible)
-			drmmode_show_cursor_image(crtc, TRUE);
-		return;
+			drmmode_crtc->cursor_plane = NULL;
+		}
+		memset(used, 0, count * sizeof(*used));
+
+		if (shared >= 0) {
+			INFO_MSG("HW cursor: sharing plane %d between CRTCs",
+					planes[shared]->plane_id);
+			cursor->ovr = planes[shared];
+			used[shared] = TRUE;
+			for (i = 0; i < xf86_config->num_crtc; i++) {
+				struct drmmode_crtc_private_rec *drmmode_crtc =
+						xf86_config->crtc[i]->driver_private;
+
+				drmmode_crtc->cursor_plane = cursor->ovr;
+			}
+		}
 	}
 
-	set_cursor_image(crtc, d, image);
+	for (j = 0; j < count; j++)
+		if (planes[j] && !used[j])
+			drmModeFreePlane(planes[j]);
 
-	if (visible)
-		drmmode_show_cursor_image(crtc, TRUE);
+	free(planes);
+	free(rank);
+	free(used);
+
+	return num_assigned == xf86_config->num_crtc || shared >= 0;
 }
 
 static Bool
@@ -626,11 +2364,10 @@ drmmode_cursor_init_plane(ScreenPtr pScreen)
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	struct drmmode_cursor_rec *cursor;
 	drmModePlaneRes *plane_resources;
-	drmModePlane *ovr;
-	int w, h, pad;
-	uint32_t handles[4], pitches[4], offsets[4]; /* we only use [0] */
+	int w, h, i;
 
 	if (drmmode->cursor) {
 		INFO_MSG("cursor already initialized");
@@ -643,10 +2380,11 @@ drmmode_cursor_init_plane(ScreenPtr pScreen)
 		return FALSE;
 	}
 
-	/* find an unused plane which can be used as a mouse cursor.  Note
-	 * that we cheat a bit, in order to not burn one overlay per crtc,
-	 * and only show the mouse cursor on one crtc at a time
-	 */
+#ifdef DRM_CLIENT_CAP_UNIVERSAL_PLANES
+	/* list the cursor planes too, not just the overlays */
+	drmSetClientCap(drmmode->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+#endif
+
 	plane_resources = drmModeGetPlaneResources(drmmode->fd);
 	if (!plane_resources) {
 		ERROR_MSG("HW cursor: drmModeGetPlaneResources failed: %s",
@@ -654,79 +2392,63 @@ drmmode_cursor_init_plane(ScreenPtr pScreen)
 		return FALSE;
 	}
 
-	if (plane_resources->count_planes < 1) {
-		ERROR_MSG("not enough planes for HW cursor");
+	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
+	if (!cursor) {
+		ERROR_MSG("HW cursor: calloc failed");
 		drmModeFreePlaneResources(plane_resources);
 		return FALSE;
 	}
 
-	ovr = drmModeGetPlane(drmmode->fd, plane_resources->planes[0]);
-	if (!ovr) {
-		ERROR_MSG("HW cursor: drmModeGetPlane failed: %s",
-					strerror(errno));
+	if (!drmmode_cursor_pick_planes(pScrn, cursor, plane_resources)) {
+		ERROR_MSG("not enough planes for HW cursor");
+		free(cursor);
 		drmModeFreePlaneResources(plane_resources);
 		return FALSE;
 	}
 
-	if (pARMSOC->drmmode_interface->init_plane_for_cursor &&
-		pARMSOC->drmmode_interface->init_plane_for_cursor(
-				drmmode->fd, ovr->plane_id)) {
-		ERROR_MSG("Failed driver-specific cursor initialization");
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-	cursor = calloc(1, sizeof(struct drmmode_cursor_rec));
-	if (!cursor) {
-		ERROR_MSG("HW cursor: calloc failed");
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
+		/* a shared plane is initialized once */
+		if (cursor->ovr && i > 0)
+			break;
 
-	cursor->ovr = ovr;
+		if (pARMSOC->drmmode_interface->init_plane_for_cursor &&
+			pARMSOC->drmmode_interface->init_plane_for_cursor(
+					drmmode->fd,
+					drmmode_crtc->cursor_plane->plane_id)) {
+			ERROR_MSG("Failed driver-specific cursor initialization");
+			drmmode_cursor_free_planes(pScrn, cursor);
+			free(cursor);
+			drmModeFreePlaneResources(plane_resources);
+			return FALSE;
+		}
+	}
 
 	w = pARMSOC->drmmode_interface->cursor_width;
 	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
-
-	/* allow for cursor padding in the bo */
-	cursor->bo  = armsoc_bo_new_with_dim(pARMSOC->dev,
-				w + 2 * pad, h,
-				0, 32, ARMSOC_BO_SCANOUT);
-
-	if (!cursor->bo) {
-		ERROR_MSG("HW cursor: buffer allocation failed");
-		free(cursor);
-		drmModeFreePlane(ovr);
-		drmModeFreePlaneResources(plane_resources);
-		return FALSE;
-	}
-
-	handles[0] = armsoc_bo_handle(cursor->bo);
-	pitches[0] = armsoc_bo_pitch(cursor->bo);
-	offsets[0] = 0;
 
-	/* allow for cursor padding in the fb */
-	if (drmModeAddFB2(drmmode->fd, w + 2 * pad, h, DRM_FORMAT_ARGB8888,
-			handles, pitches, offsets, &cursor->fb_id, 0)) {
-		ERROR_MSG("HW cursor: drmModeAddFB2 failed: %s",
-					strerror(errno));
-		armsoc_bo_unreference(cursor->bo);
+	/* the first cache entry; the others are allocated on demand */
+	if (!drmmode_cursor_image_alloc(pScrn, &cursor->images[0])) {
+		drmmode_cursor_free_planes(pScrn, cursor);
 		free(cursor);
-		drmModeFreePlane(ovr);
 		drmModeFreePlaneResources(plane_resources);
 		return FALSE;
 	}
-
-	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
+	drmmode_cursor_use_image(cursor, 0);
+
+	/* allocated here, as it is armed from the SIGIO handler on older
+	 * servers where malloc isn't safe */
+	cursor->move_timer = TimerSet(NULL, 0, 0,
+			drmmode_cursor_move_timer, pScrn);
+	if (!cursor->move_timer ||
+	    !xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
 		ERROR_MSG("xf86_cursors_init() failed");
-		if (drmModeRmFB(drmmode->fd, cursor->fb_id))
-			ERROR_MSG("drmModeRmFB() failed");
-
-		armsoc_bo_unreference(cursor->bo);
+		TimerFree(cursor->move_timer);
+		drmmode_cursor_image_free(pScrn, &cursor->images[0]);
+		drmmode_cursor_free_planes(pScrn, cursor);
 		free(cursor);
-		drmModeFreePlane(ovr);
 		drmModeFreePlaneResources(plane_resources);
 		return FALSE;
 	}
@@ -734,6 +2456,8 @@ drmmode_cursor_init_plane(ScreenPtr pScreen)
 	INFO_MSG("HW cursor initialized");
 	drmmode->cursor = cursor;
 	drmModeFreePlaneResources(plane_resources);
+	if (drmmode->atomic)
+		drmmode_cursor_atomic_init(pScrn);
 	return TRUE;
 }
 
@@ -744,7 +2468,7 @@ drmmode_cursor_init_standard(ScreenPtr pScreen)
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 	struct drmmode_cursor_rec *cursor;
-	int w, h, pad;
+	int w, h;
 
 	if (drmmode->cursor) {
 		INFO_MSG("cursor already initialized");
@@ -766,27 +2490,23 @@ drmmode_cursor_init_standard(ScreenPtr pScreen)
 
 	w = pARMSOC->drmmode_interface->cursor_width;
 	h = pARMSOC->drmmode_interface->cursor_height;
-	pad = pARMSOC->drmmode_interface->cursor_padding;
-
-	/* allow for cursor padding in the bo */
-	cursor->bo  = armsoc_bo_new_with_dim(pARMSOC->dev,
-				w + 2 * pad, h,
-				0, 32, ARMSOC_BO_SCANOUT);
 
-	if (!cursor->bo) {
-		ERROR_MSG("HW cursor (standard): buffer allocation failed");
+	/* the first cache entry; the others are allocated on demand */
+	if (!drmmode_cursor_image_alloc(pScrn, &cursor->images[0])) {
 		free(cursor);
 		return FALSE;
 	}
-
-	cursor->handle = armsoc_bo_handle(cursor->bo);
-
-	if (!xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
+	drmmode_cursor_use_image(cursor, 0);
+
+	/* allocated here, as it is armed from the SIGIO handler on older
+	 * servers where malloc isn't safe */
+	cursor->move_timer = TimerSet(NULL, 0, 0,
+			drmmode_cursor_move_timer, pScrn);
+	if (!cursor->move_timer ||
+	    !xf86_cursors_init(pScreen, w, h, HARDWARE_CURSOR_ARGB)) {
 		ERROR_MSG("xf86_cursors_init() failed");
-		if (drmModeRmFB(drmmode->fd, cursor->fb_id))
-			ERROR_MSG("drmModeRmFB() failed");
-
-		armsoc_bo_unreference(cursor->bo);
+		TimerFree(cursor->move_timer);
+		drmmode_cursor_image_free(pScrn, &cursor->images[0]);
 		free(cursor);
 		return FALSE;
 	}
@@ -821,17 +2541,18 @@ void drmmode_cursor_fini(ScreenPtr pScreen)
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 	struct drmmode_cursor_rec *cursor = drmmode->cursor;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	int i;
 
 	if (!cursor)
 		return;
 
 	drmmode->cursor = NULL;
+	TimerFree(cursor->move_timer);
 	xf86_cursors_fini(pScreen);
+	for (i = 0; i < ARMSOC_CURSOR_CACHE_SIZE; i++)
+		drmmode_cursor_image_free(pScrn, &cursor->images[i]);
 	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		drmModeRmFB(drmmode->fd, cursor->fb_id);
-	armsoc_bo_unreference(cursor->bo);
-	if (pARMSOC->drmmode_interface->cursor_api == HWCURSOR_API_PLANE)
-		drmModeFreePlane(cursor->ovr);
+		drmmode_cursor_free_planes(pScrn, cursor);
 	free(cursor);
 }
 
@@ -881,8 +2602,12 @@ drmmode_crtc_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 
 	drmmode_crtc = xnfcalloc(1, sizeof *drmmode_crtc);
 	drmmode_crtc->crtc_id = drmmode->mode_res->crtcs[num];
+	drmmode_crtc->pipe = num;
+	drmmode_crtc->dpms_mode = DPMSModeOn;
 	drmmode_crtc->drmmode = drmmode;
 	drmmode_crtc->last_good_mode = NULL;
+	RegionNull(&drmmode_crtc->scanout_damage);
+	RegionNull(&drmmode_crtc->scanout_stale);
 
 	INFO_MSG("Got CRTC: %d (id: %d)",
 			num, drmmode_crtc->crtc_id);
@@ -892,18 +2617,40 @@ drmmode_crtc_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 	return;
 }
 
+/*
+ * Connector state as the kernel last saw it. Unlike drmModeGetConnector
+ * this doesn't probe the display again, which on HDMI and DP means
+ * reading the EDID over DDC, so it is what to use for anything but
+ * detecting what is connected.
+ */
+static drmModeConnectorPtr
+drmmode_get_connector_current(int fd, uint32_t connector_id)
+{
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+	return drmModeGetConnectorCurrent(fd, connector_id);
+#else
+	return drmModeGetConnector(fd, connector_id);
+#endif
+}
+
 static xf86OutputStatus
 drmmode_output_detect(xf86OutputPtr output)
 {
 	/* go to the hw and retrieve a new output struct */
 	struct drmmode_output_priv *drmmode_output = output->driver_private;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	drmModeConnectorPtr connector;
 	xf86OutputStatus status;
-	drmModeFreeConnector(drmmode_output->connector);
 
-	drmmode_output->connector =
-			drmModeGetConnector(drmmode->fd,
-					drmmode_output->output_id);
+	if (!drmmode_output->unchanged) {
+		connector = drmModeGetConnector(drmmode->fd,
+				drmmode_output->output_id);
+		if (!connector)
+			return XF86OutputStatusUnknown;
+
+		drmModeFreeConnector(drmmode_output->connector);
+		drmmode_output->connector = connector;
+	}
 
 	switch (drmmode_output->connector->connection) {
 	case DRM_MODE_CONNECTED:
@@ -930,6 +2677,71 @@ drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
 	return MODE_OK;
 }
 
+/* Value of a connector property, as of when the connector was fetched */
+static Bool
+drmmode_connector_prop_value(drmModeConnectorPtr connector, uint32_t prop_id,
+		uint64_t *value)
+{
+	int i;
+
+	if (!prop_id)
+		return FALSE;
+
+	for (i = 0; i < connector->count_props; i++) {
+		if (connector->props[i] == prop_id) {
+			*value = connector->prop_values[i];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static uint32_t
+drmmode_hash(uint32_t hash, const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < size; i++)	/* FNV-1a */
+		hash = (hash ^ p[i]) * 16777619u;
+	return hash;
+}
+
+static void
+drmmode_free_modes(DisplayModePtr modes)
+{
+	DisplayModePtr next;
+
+	for (; modes; modes = next) {
+		next = modes->next;
+		free((void *)modes->name);
+		free(modes);
+	}
+}
+
+/* Whether the EDID and kernel modes are those the output's modes were made
+ * from: the hash matches, and so do the bytes */
+static Bool
+drmmode_output_modes_match(struct drmmode_output_priv *drmmode_output,
+		uint32_t hash, const void *edid, size_t edid_len,
+		const void *kmodes, size_t kmodes_len)
+{
+	return drmmode_output->modes_valid &&
+		drmmode_output->modes_hash == hash &&
+		drmmode_output->modes_edid_len == edid_len &&
+		drmmode_output->modes_kmodes_len == kmodes_len &&
+		(!edid_len ||
+		 !memcmp(drmmode_output->modes_key, edid, edid_len)) &&
+		(!kmodes_len ||
+		 !memcmp(drmmode_output->modes_key + edid_len, kmodes,
+				kmodes_len));
+}
+
+/*
+ * The monitor and modes are made from the EDID and the kernel's modes
+ * only when those change; a monitor probed again gives the same ones,
+ * so most probes return a copy of the modes made last time.
+ */
 static DisplayModePtr
 drmmode_output_get_modes(xf86OutputPtr output)
 {
@@ -938,27 +2750,39 @@ drmmode_output_get_modes(xf86OutputPtr output)
 	drmModeConnectorPtr connector = drmmode_output->connector;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
 	DisplayModePtr modes = NULL;
-	drmModePropertyPtr prop;
 	xf86MonPtr ddc_mon = NULL;
+	uint64_t blob_id;
+	uint32_t hash;
+	const void *edid = NULL;
+	size_t edid_len = 0, kmodes_len;
 	int i;
 
-	/* look for an EDID property */
-	for (i = 0; i < connector->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
-		if (!prop)
-			continue;
+	/* the EDID the output has is still the monitor's */
+	if (drmmode_output->unchanged)
+		goto modes;
 
-		if ((prop->flags & DRM_MODE_PROP_BLOB) &&
-		    !strcmp(prop->name, "EDID")) {
-			if (drmmode_output->edid_blob)
-				drmModeFreePropertyBlob(
-						drmmode_output->edid_blob);
-			drmmode_output->edid_blob =
-					drmModeGetPropertyBlob(drmmode->fd,
-						connector->prop_values[i]);
-		}
-		drmModeFreeProperty(prop);
+	if (drmmode_connector_prop_value(connector, drmmode_output->prop_edid,
+			&blob_id)) {
+		if (drmmode_output->edid_blob)
+			drmModeFreePropertyBlob(drmmode_output->edid_blob);
+		drmmode_output->edid_blob =
+				drmModeGetPropertyBlob(drmmode->fd, blob_id);
+	}
+
+modes:
+	if (drmmode_output->edid_blob) {
+		edid = drmmode_output->edid_blob->data;
+		edid_len = drmmode_output->edid_blob->length;
 	}
+	kmodes_len = connector->count_modes * sizeof(*connector->modes);
+	hash = drmmode_hash(2166136261u, edid, edid_len);
+	hash = drmmode_hash(hash, connector->modes, kmodes_len);
+
+	/* the server drops the monitor of an output that is disconnected */
+	if (drmmode_output_modes_match(drmmode_output, hash,
+			edid, edid_len, connector->modes, kmodes_len) &&
+	    (!edid || output->MonInfo))
+		return xf86DuplicateModes(pScrn, drmmode_output->modes);
 
 	if (drmmode_output->edid_blob)
 		ddc_mon = xf86InterpretEDID(pScrn->scrnIndex,
@@ -980,7 +2804,22 @@ drmmode_output_get_modes(xf86OutputPtr output)
 		drmmode_ConvertFromKMode(pScrn, &connector->modes[i], mode);
 		modes = xf86ModesAdd(modes, mode);
 	}
-	return modes;
+
+	drmmode_free_modes(drmmode_output->modes);
+	drmmode_output->modes = modes;
+	drmmode_output->modes_hash = hash;
+	free(drmmode_output->modes_key);
+	drmmode_output->modes_key = malloc(edid_len + kmodes_len);
+	drmmode_output->modes_edid_len = edid_len;
+	drmmode_output->modes_kmodes_len = kmodes_len;
+	if (edid_len && drmmode_output->modes_key)
+		memcpy(drmmode_output->modes_key, edid, edid_len);
+	if (kmodes_len && drmmode_output->modes_key)
+		memcpy(drmmode_output->modes_key + edid_len, connector->modes,
+				kmodes_len);
+	drmmode_output->modes_valid = drmmode_output->modes_key ||
+			!(edid_len + kmodes_len);
+	return xf86DuplicateModes(pScrn, modes);
 }
 
 static void
@@ -991,6 +2830,8 @@ drmmode_output_destroy(xf86OutputPtr output)
 
 	if (drmmode_output->edid_blob)
 		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+	drmmode_free_modes(drmmode_output->modes);
+	free(drmmode_output->modes_key);
 
 	for (i = 0; i < drmmode_output->num_props; i++) {
 		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
@@ -1012,29 +2853,13 @@ static void
 drmmode_output_dpms(xf86OutputPtr output, int mode)
 {
 	struct drmmode_output_priv *drmmode_output = output->driver_private;
-	drmModeConnectorPtr connector = drmmode_output->connector;
-	drmModePropertyPtr prop;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
-	int mode_id = -1, i;
-
-	for (i = 0; i < connector->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
-		if (!prop)
-			continue;
-		if ((prop->flags & DRM_MODE_PROP_ENUM) &&
-		    !strcmp(prop->name, "DPMS")) {
-			mode_id = connector->props[i];
-			drmModeFreeProperty(prop);
-			break;
-		}
-		drmModeFreeProperty(prop);
-	}
 
-	if (mode_id < 0)
+	if (!drmmode_output->prop_dpms)
 		return;
 
-	drmModeConnectorSetProperty(drmmode->fd, connector->connector_id,
-			mode_id, mode);
+	drmModeConnectorSetProperty(drmmode->fd, drmmode_output->output_id,
+			drmmode_output->prop_dpms, mode);
 }
 
 static Bool
@@ -1242,14 +3067,18 @@ drmmode_output_get_property(xf86OutputPtr output, Atom property)
 
 	struct drmmode_output_priv *drmmode_output = output->driver_private;
 	struct drmmode_rec *drmmode = drmmode_output->drmmode;
+	drmModeConnectorPtr connector;
 	uint32_t value;
 	int err, i;
 
+	/* refresh the property values, without probing the display */
 	if (output->scrn->vtSema) {
-		drmModeFreeConnector(drmmode_output->connector);
-		drmmode_output->connector =
-				drmModeGetConnector(drmmode->fd,
-						drmmode_output->output_id);
+		connector = drmmode_get_connector_current(drmmode->fd,
+				drmmode_output->output_id);
+		if (connector) {
+			drmModeFreeConnector(drmmode_output->connector);
+			drmmode_output->connector = connector;
+		}
 	}
 
 	for (i = 0; i < drmmode_output->num_props; i++) {
@@ -1330,7 +3159,9 @@ drmmode_output_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 
 	TRACE_ENTER();
 
-	connector = drmModeGetConnector(drmmode->fd, drmmode->mode_res->connectors[num]);
+	/* detect() probes the display when the outputs are first probed */
+	connector = drmmode_get_connector_current(drmmode->fd,
+			drmmode->mode_res->connectors[num]);
 	if (!connector)
 		goto exit;
 
@@ -1364,6 +3195,22 @@ drmmode_output_init(ScrnInfoPtr pScrn, struct drmmode_rec *drmmode, int num)
 	drmmode_output->encoders = encoders;
 	drmmode_output->drmmode = drmmode;
 
+	/* look up the properties we use ourselves once, not on each use */
+	for (i = 0; i < connector->count_props; i++) {
+		drmModePropertyPtr prop;
+
+		prop = drmModeGetProperty(drmmode->fd, connector->props[i]);
+		if (!prop)
+			continue;
+		if ((prop->flags & DRM_MODE_PROP_BLOB) &&
+		    !strcmp(prop->name, "EDID"))
+			drmmode_output->prop_edid = prop->prop_id;
+		else if ((prop->flags & DRM_MODE_PROP_ENUM) &&
+			 !strcmp(prop->name, "DPMS"))
+			drmmode_output->prop_dpms = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+
 	output->mm_width = connector->mmWidth;
 	output->mm_height = connector->mmHeight;
 	output->driver_private = drmmode_output;
@@ -1458,7 +3305,7 @@ void set_scanout_bo(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
 
 	old_scanout = pARMSOC->scanout;
 	/* It had better have a framebuffer if we're scanning it out */
-	assert(armsoc_bo_get_fb(bo));
+	assert(pARMSOC->PerCrtcScanout || armsoc_bo_get_fb(bo));
 
 	armsoc_bo_reference(bo); /* Screen takes ref on new scanout bo */
 	pARMSOC->scanout = bo;
@@ -1466,6 +3313,97 @@ void set_scanout_bo(ScrnInfoPtr pScrn, struct armsoc_bo *bo)
 		armsoc_bo_unreference(old_scanout); /* Screen drops ref on old scanout bo */
 }
 
+/* Remove the framebuffer left behind by an in-place resize, once nothing
+ * scans it out any more */
+static void
+drmmode_retire_fb(ScrnInfoPtr pScrn)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+
+	if (drmmode->retired_fb_id) {
+		drmModeRmFB(drmmode->fd, drmmode->retired_fb_id);
+		drmmode->retired_fb_id = 0;
+	}
+}
+
+/**
+ * Resize the scanout bo within the memory it already has. The pitch is
+ * kept when the new width fits in it, so what is on the screen stays in
+ * place and only the newly exposed parts need clearing. The old
+ * framebuffer stays until drmmode_retire_fb(), so the CRTCs keep showing
+ * it until they are set to the new one. Returns FALSE, with nothing
+ * changed, if the bo is too small.
+ */
+static Bool
+drmmode_resize_scanout_in_place(ScrnInfoPtr pScrn, int width, int height)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct armsoc_bo *bo = pARMSOC->scanout;
+	int old_width = armsoc_bo_width(bo);
+	int old_height = armsoc_bo_height(bo);
+	uint32_t old_pitch = armsoc_bo_pitch(bo);
+	uint32_t old_size = armsoc_bo_size(bo);
+	uint32_t cpp = (armsoc_bo_bpp(bo) + 7) / 8;
+	uint32_t pitch, old_fb_id;
+	unsigned char *map;
+	int y;
+
+	if (!armsoc_bo_can_resize(bo, width, height))
+		return FALSE;
+
+	map = armsoc_bo_map(bo);
+	if (!map)
+		return FALSE;
+
+	/* before touching the framebuffer, so that failing here leaves
+	 * the screen as it is */
+	if (armsoc_bo_cpu_prep(bo, ARMSOC_GEM_WRITE))
+		return FALSE;
+
+	drmmode_retire_fb(pScrn);
+	old_fb_id = armsoc_bo_release_fb(bo);
+
+	if (armsoc_bo_resize(bo, width, height)) {
+		armsoc_bo_cpu_fini(bo, ARMSOC_GEM_WRITE);
+		goto fail;
+	}
+
+	pitch = armsoc_bo_pitch(bo);
+	if (pitch != old_pitch) {
+		armsoc_zero_stream(map, armsoc_bo_size(bo));
+	} else {
+		for (y = 0; y < min(height, old_height); y++)
+			if (width > old_width)
+				armsoc_zero_stream(map + y * pitch +
+						old_width * cpp,
+						(width - old_width) * cpp);
+		/* whole new rows are contiguous */
+		if (height > old_height)
+			armsoc_zero_stream(map + old_height * pitch,
+					(height - old_height - 1) * pitch +
+					width * cpp);
+	}
+	armsoc_bo_cpu_fini(bo, ARMSOC_GEM_WRITE);
+
+	if (!pARMSOC->PerCrtcScanout && armsoc_bo_add_fb(bo)) {
+		ERROR_MSG("Failed to add framebuffer to the resized scanout buffer");
+		goto fail;
+	}
+
+	drmmode->retired_fb_id = old_fb_id;
+	DEBUG_MSG("resized scanout buffer in place: %dx%d -> %dx%d",
+			old_width, old_height, width, height);
+	return TRUE;
+
+fail:
+	/* the CRTCs still scan out the old framebuffer, so give it back
+	 * to the bo rather than removing it from under them */
+	armsoc_bo_restore_fb(bo, old_width, old_height, old_pitch, old_size,
+			old_fb_id);
+	return FALSE;
+}
+
 static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 {
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
@@ -1491,11 +3429,27 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 		(height != armsoc_bo_height(pARMSOC->scanout))) {
 		struct armsoc_bo *new_scanout;
 
+		/* Pooled buffers are the old screen size. Release them
+		 * first to make room for the new scanout; the pool is
+		 * refilled at the new size from the block handler. */
+		armsoc_scanout_pool_flush(pScrn);
+
+		/* Reuse the memory of the current scanout when it is big
+		 * enough, to save allocating and clearing a new one */
+		if (drmmode_resize_scanout_in_place(pScrn, width, height)) {
+			pitch = armsoc_bo_pitch(pARMSOC->scanout);
+			pScrn->displayWidth = pitch /
+					((pScrn->bitsPerPixel + 7) / 8);
+			goto modify_pixmap;
+		}
+
 		/* resize_scanout_bo creates and takes ref on new scanout bo */
 		new_scanout = armsoc_bo_new_with_dim(pARMSOC->dev,
 				width, height,
 				depth, bpp,
-				ARMSOC_BO_SCANOUT);
+				pARMSOC->PerCrtcScanout ?
+					ARMSOC_BO_NON_SCANOUT :
+					ARMSOC_BO_SCANOUT);
 		if (!new_scanout) {
 			/* Try to use the previous buffer if the new resolution
 			 * is smaller than the one on buffer creation
@@ -1503,13 +3457,15 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 			DEBUG_MSG(
 					"allocate new scanout buffer failed - resizing existing bo");
 			/* Remove the old fb from the bo */
-			if (armsoc_bo_rm_fb(pARMSOC->scanout))
+			if (armsoc_bo_get_fb(pARMSOC->scanout) &&
+			    armsoc_bo_rm_fb(pARMSOC->scanout))
 				return FALSE;
 
 			/* Resize the bo */
 			if (armsoc_bo_resize(pARMSOC->scanout, width, height)) {
 				armsoc_bo_clear(pARMSOC->scanout);
-				if (armsoc_bo_add_fb(pARMSOC->scanout))
+				if (!pARMSOC->PerCrtcScanout &&
+				    armsoc_bo_add_fb(pARMSOC->scanout))
 					ERROR_MSG(
 							"Failed to add framebuffer to the existing scanout buffer");
 				return FALSE;
@@ -1519,7 +3475,8 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 			if (armsoc_bo_clear(pARMSOC->scanout))
 				return FALSE;
 
-			if (armsoc_bo_add_fb(pARMSOC->scanout)) {
+			if (!pARMSOC->PerCrtcScanout &&
+			    armsoc_bo_add_fb(pARMSOC->scanout)) {
 				ERROR_MSG(
 						"Failed to add framebuffer to the existing scanout buffer");
 				return FALSE;
@@ -1538,7 +3495,8 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 				return FALSE;
 			}
 
-			if (armsoc_bo_add_fb(new_scanout)) {
+			if (!pARMSOC->PerCrtcScanout &&
+			    armsoc_bo_add_fb(new_scanout)) {
 				ERROR_MSG(
 						"Failed to add framebuffer to the new scanout buffer");
 				/* resize_scanout_bo drops ref on new scanout on failure exit */
@@ -1570,6 +3528,7 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 	} else
 		pitch = armsoc_bo_pitch(pARMSOC->scanout);
 
+modify_pixmap:
 	if (pScreen && pScreen->ModifyPixmapHeader) {
 		PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
 
@@ -1598,130 +3557,784 @@ static Bool resize_scanout_bo(ScrnInfoPtr pScrn, int width, int height)
 		 * DRI2Buffer will be returned, even though the backing buffer
 		 * has been deleted.
 		 */
-		rootPixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+		rootPixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+	}
+	TRACE_EXIT();
+	return TRUE;
+}
+
+static Bool
+drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+{
+	int i;
+	xf86CrtcConfigPtr xf86_config;
+
+	TRACE_ENTER();
+	if (!resize_scanout_bo(pScrn, width, height))
+		goto fail;
+
+	/* Framebuffer needs to be reset on all CRTCs, not just
+	 * those that have repositioned */
+	xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+
+		if (!crtc->enabled)
+			continue;
+
+		drmmode_set_mode_major(crtc, &crtc->mode,
+				crtc->rotation, crtc->x, crtc->y);
+	}
+	drmmode_retire_fb(pScrn);
+
+	TRACE_EXIT();
+	return TRUE;
+
+fail:
+	TRACE_EXIT();
+	return FALSE;
+}
+
+static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
+		.resize = drmmode_xf86crtc_resize
+};
+
+
+Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
+{
+	struct drmmode_rec *drmmode;
+	int i;
+
+	TRACE_ENTER();
+
+	drmmode = calloc(1, sizeof(*drmmode));
+	if (!drmmode)
+		return FALSE;
+
+	drmmode->fd = fd;
+
+	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+
+
+	drmmode->cpp = cpp;
+	drmmode->mode_res = drmModeGetResources(drmmode->fd);
+	if (!drmmode->mode_res) {
+		free(drmmode);
+		return FALSE;
+	} else {
+		DEBUG_MSG("Got KMS resources");
+		DEBUG_MSG("  %d connectors, %d encoders",
+				drmmode->mode_res->count_connectors,
+				drmmode->mode_res->count_encoders);
+		DEBUG_MSG("  %d crtcs, %d fbs",
+				drmmode->mode_res->count_crtcs,
+				drmmode->mode_res->count_fbs);
+		DEBUG_MSG("  %dx%d minimum resolution",
+				drmmode->mode_res->min_width,
+				drmmode->mode_res->min_height);
+		DEBUG_MSG("  %dx%d maximum resolution",
+				drmmode->mode_res->max_width,
+				drmmode->mode_res->max_height);
+	}
+	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
+			drmmode->mode_res->max_height);
+
+#ifdef DRM_CAP_ASYNC_PAGE_FLIP
+	{
+		uint64_t value = 0;
+
+		if (!drmGetCap(drmmode->fd, DRM_CAP_ASYNC_PAGE_FLIP, &value))
+			drmmode->async_flip_supported = value ? TRUE : FALSE;
+	}
+#endif
+	if (ARMSOCPTR(pScrn)->AsyncFlip && !drmmode->async_flip_supported) {
+		INFO_MSG("Asynchronous page flips not supported by the kernel");
+		ARMSOCPTR(pScrn)->AsyncFlip = FALSE;
+	}
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+	/* There is no cap for these; they are dropped on the first call
+	 * the kernel doesn't understand.
+	 */
+	drmmode->crtc_sequence_supported = TRUE;
+#endif
+
+	if (ARMSOCPTR(pScrn)->crtcNum == -1) {
+		INFO_MSG("Adding all CRTCs");
+		for (i = 0; i < drmmode->mode_res->count_crtcs; i++)
+			drmmode_crtc_init(pScrn, drmmode, i);
+	} else if (ARMSOCPTR(pScrn)->crtcNum < drmmode->mode_res->count_crtcs) {
+		drmmode_crtc_init(pScrn, drmmode, ARMSOCPTR(pScrn)->crtcNum);
+	} else {
+		ERROR_MSG(
+				"Specified more Screens in xorg.conf than there are DRM CRTCs");
+		return FALSE;
+	}
+
+	if (ARMSOCPTR(pScrn)->crtcNum != -1) {
+		if (ARMSOCPTR(pScrn)->crtcNum <
+				drmmode->mode_res->count_connectors)
+			drmmode_output_init(pScrn,
+					drmmode, ARMSOCPTR(pScrn)->crtcNum);
+		else
+			return FALSE;
+	} else {
+		for (i = 0; i < drmmode->mode_res->count_connectors; i++)
+			drmmode_output_init(pScrn, drmmode, i);
+	}
+	drmmode_clones_init(pScrn, drmmode);
+
+	if (ARMSOCPTR(pScrn)->Atomic) {
+		if (drmmode_atomic_init(pScrn, drmmode)) {
+			INFO_MSG("Using atomic modesetting");
+		} else {
+			INFO_MSG("Atomic modesetting not available, using legacy modesetting");
+			ARMSOCPTR(pScrn)->Atomic = FALSE;
+		}
+	}
+
+	xf86InitialConfiguration(pScrn, TRUE);
+
+	TRACE_EXIT();
+
+	return TRUE;
+}
+
+/**
+ * Move the viewport of a CRTC that is already showing the screen, keeping
+ * its mode. Only the scanout offset changes: with PerCrtcScanout the
+ * CRTC's buffer is refilled from the new position, with atomic
+ * modesetting the primary plane's source is moved, and otherwise the
+ * CRTC is set again with an unchanged mode, which kernels handle as a
+ * base address update. Returns FALSE if a full modeset is needed.
+ */
+static Bool
+drmmode_crtc_pan(xf86CrtcPtr crtc, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	uint32_t output_ids[32];
+	int output_count = 0;
+	int old_x = crtc->x, old_y = crtc->y;
+	uint32_t fb_id;
+	drmModeModeInfo kmode;
+	int i, err;
+
+	if (drmmode_crtc->dpms_mode != DPMSModeOn ||
+	    !drmmode_crtc->scanout_fb_id || !drmmode_crtc->last_good_mode ||
+	    crtc->rotation != RR_Rotate_0 || crtc->transformPresent)
+		return FALSE;
+
+	crtc->x = x;
+	crtc->y = y;
+	if (!xf86CrtcRotate(crtc))
+		goto fail;
+
+	if (pARMSOC->PerCrtcScanout) {
+		if (!drmmode_crtc->scanout)
+			goto fail;
+		drmmode_crtc_scanout_wait(crtc);
+		drmmode_crtc_scanout_copy_all(crtc, drmmode_crtc->scanout);
+		drmmode_crtc_scanout_set(crtc, drmmode_crtc->scanout);
+		goto done;
+	}
+
+	fb_id = armsoc_bo_get_fb(pARMSOC->scanout);
+	if (!fb_id)
+		goto fail;
+
+	if (drmmode->atomic) {
+		err = drmmode_crtc_atomic_pan(crtc, fb_id, x, y);
+	} else {
+		for (i = 0; i < xf86_config->num_output; i++) {
+			xf86OutputPtr output = xf86_config->output[i];
+			struct drmmode_output_priv *drmmode_output =
+					output->driver_private;
+
+			if (output->crtc != crtc)
+				continue;
+			if (output_count == (int)ARRAY_SIZE(output_ids))
+				goto fail;
+			output_ids[output_count++] =
+					drmmode_output->connector->connector_id;
+		}
+
+		drmmode_ConvertToKMode(pScrn, &kmode, &crtc->mode);
+		err = drmModeSetCrtc(drmmode->fd, drmmode_crtc->crtc_id,
+				fb_id, x, y, output_ids, output_count, &kmode);
+	}
+	if (err) {
+		DEBUG_MSG("pan of crtc %d failed: %s", drmmode_crtc->crtc_id,
+				strerror(-err));
+		goto fail;
+	}
+
+	drmmode_crtc->scanout_fb_id = fb_id;
+
+done:
+	drmmode_crtc->last_good_x = x;
+	drmmode_crtc->last_good_y = y;
+	pARMSOC->crtc_config_serial++;
+
+	/* the cursor is positioned relative to the CRTC */
+	if (drmmode->cursor)
+		xf86_reload_cursors(pScrn->pScreen);
+
+	return TRUE;
+
+fail:
+	crtc->x = old_x;
+	crtc->y = old_y;
+	xf86CrtcRotate(crtc);
+	return FALSE;
+}
+
+void
+drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86OutputPtr output = config->output[config->compat_output];
+	xf86CrtcPtr crtc = output->crtc;
+
+	if (!crtc || !crtc->enabled)
+		return;
+
+	if (!drmmode_crtc_pan(crtc, x, y))
+		drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation,
+				x, y);
+}
+
+/**
+ * Find the CRTC that shows the largest part of a box, given in screen
+ * coordinates. Returns NULL if the box isn't visible on any active CRTC.
+ */
+xf86CrtcPtr
+drmmode_covering_crtc(ScrnInfoPtr pScrn, BoxPtr box)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86CrtcPtr best = NULL;
+	int best_area = 0;
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		xf86CrtcPtr crtc = config->crtc[i];
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				crtc->driver_private;
+		int x1, y1, x2, y2, area;
+
+		if (!crtc->enabled || drmmode_crtc->dpms_mode != DPMSModeOn)
+			continue;
+
+		x1 = max(box->x1, crtc->bounds.x1);
+		y1 = max(box->y1, crtc->bounds.y1);
+		x2 = min(box->x2, crtc->bounds.x2);
+		y2 = min(box->y2, crtc->bounds.y2);
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		area = (x2 - x1) * (y2 - y1);
+		if (area > best_area) {
+			best = crtc;
+			best_area = area;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * The bits selecting a CRTC in the type of a drmWaitVBlank() request.
+ * CRTCs other than the first two need the high CRTC encoding.
+ */
+uint32_t
+drmmode_crtc_vblank_pipe(xf86CrtcPtr crtc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+
+	if (!crtc)
+		return 0;
+
+	drmmode_crtc = crtc->driver_private;
+	if (drmmode_crtc->pipe > 1)
+		return (drmmode_crtc->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+				DRM_VBLANK_HIGH_CRTC_MASK;
+	else if (drmmode_crtc->pipe > 0)
+		return DRM_VBLANK_SECONDARY;
+	else
+		return 0;
+}
+
+static xf86CrtcPtr
+drmmode_vblank_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+	/* vblank requests without a CRTC go to the first one */
+	if (!crtc && config->num_crtc > 0)
+		crtc = config->crtc[0];
+	return crtc;
+}
+
+/**
+ * Find the CRTC with the given KMS object id.
+ */
+xf86CrtcPtr
+drmmode_crtc_from_id(ScrnInfoPtr pScrn, uint32_t crtc_id)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->crtc_id == crtc_id)
+			return config->crtc[i];
+	}
+	return NULL;
+}
+
+/* Kernel vblank timestamps are CLOCK_MONOTONIC */
+static uint64_t
+drmmode_monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Nominal frame period of a mode in microseconds, or 0 if unknown */
+static uint32_t
+drmmode_mode_frame_period(const DisplayModeRec *mode)
+{
+	uint64_t period;
+
+	if (mode->Clock <= 0 || mode->HTotal <= 0 || mode->VTotal <= 0)
+		return 0;
+
+	period = (uint64_t)mode->HTotal * mode->VTotal * 1000 / mode->Clock;
+	if (mode->Flags & V_INTERLACE)
+		period /= 2;
+	if (mode->Flags & V_DBLSCAN)
+		period *= 2;
+	if (mode->VScan > 1)
+		period *= mode->VScan;
+
+	return period;
+}
+
+static void
+drmmode_crtc_sync_clock(xf86CrtcPtr crtc, uint64_t msc, uint64_t ust,
+		Bool force)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+
+	if (drmmode_crtc->vbl_valid &&
+	    drmmode_crtc->vbl_serial == pARMSOC->crtc_config_serial) {
+		/* Events can arrive after a query already told us about a
+		 * later vblank; don't step the clock backwards.
+		 */
+		if (!force && ust <= drmmode_crtc->vbl_ust)
+			return;
+		/* Refine the period from what the hardware really does */
+		if (msc > drmmode_crtc->vbl_msc && ust > drmmode_crtc->vbl_ust)
+			drmmode_crtc->vbl_period =
+				(ust - drmmode_crtc->vbl_ust) /
+				(msc - drmmode_crtc->vbl_msc);
+	} else {
+		drmmode_crtc->vbl_period =
+				drmmode_mode_frame_period(&crtc->mode);
+	}
+
+	drmmode_crtc->vbl_msc = msc;
+	drmmode_crtc->vbl_ust = ust;
+	drmmode_crtc->vbl_serial = pARMSOC->crtc_config_serial;
+	drmmode_crtc->vbl_valid = TRUE;
+}
+
+/*
+ * Software vblank source, for kernels that can't tell us about vblanks.
+ * The clock model is then free-running at the nominal frame period of
+ * the mode, and page flip events (which still complete at vblank) pull
+ * its phase into line with the hardware.
+ */
+
+static void
+drmmode_crtc_soft_clock(xf86CrtcPtr crtc, uint64_t now,
+		uint64_t *ust, uint64_t *msc)
+{
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	uint64_t frames = 0;
+
+	if (!drmmode_crtc->vbl_valid ||
+	    drmmode_crtc->vbl_serial != pARMSOC->crtc_config_serial) {
+		/* Start over at the current count, so that the counter keeps
+		 * going up across mode changes.
+		 */
+		if (drmmode_crtc->vbl_valid && drmmode_crtc->vbl_period &&
+		    now > drmmode_crtc->vbl_ust)
+			drmmode_crtc->vbl_msc += (now - drmmode_crtc->vbl_ust) /
+					drmmode_crtc->vbl_period;
+		drmmode_crtc->vbl_period =
+				drmmode_mode_frame_period(&crtc->mode);
+		if (!drmmode_crtc->vbl_period)
+			drmmode_crtc->vbl_period = ARMSOC_SOFT_VBLANK_PERIOD;
+		drmmode_crtc->vbl_ust = now;
+		drmmode_crtc->vbl_serial = pARMSOC->crtc_config_serial;
+		drmmode_crtc->vbl_valid = TRUE;
 	}
-	TRACE_EXIT();
-	return TRUE;
+
+	if (now > drmmode_crtc->vbl_ust)
+		frames = (now - drmmode_crtc->vbl_ust) /
+				drmmode_crtc->vbl_period;
+	*msc = drmmode_crtc->vbl_msc + frames;
+	*ust = drmmode_crtc->vbl_ust + frames * drmmode_crtc->vbl_period;
+	if (*msc > drmmode_crtc->vbl_soft_msc)
+		drmmode_crtc->vbl_soft_msc = *msc;
 }
 
-static Bool
-drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+/* Move the phase of the software clock to a vblank seen at ust */
+static void
+drmmode_crtc_soft_lock(xf86CrtcPtr crtc, uint64_t ust)
 {
-	int i;
-	xf86CrtcConfigPtr xf86_config;
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(crtc->scrn);
+	uint64_t now, msc, frames = 0;
 
-	TRACE_ENTER();
-	if (!resize_scanout_bo(pScrn, width, height))
-		goto fail;
+	if (!drmmode_crtc->vbl_valid ||
+	    drmmode_crtc->vbl_serial != pARMSOC->crtc_config_serial ||
+	    ust <= drmmode_crtc->vbl_ust)
+		return;
 
-	/* Framebuffer needs to be reset on all CRTCs, not just
-	 * those that have repositioned */
-	xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	for (i = 0; i < xf86_config->num_crtc; i++) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
+	msc = drmmode_crtc->vbl_msc + (ust - drmmode_crtc->vbl_ust +
+			drmmode_crtc->vbl_period / 2) / drmmode_crtc->vbl_period;
 
-		if (!crtc->enabled)
+	/* Rounding to the nearest vblank can put the count now behind one
+	 * already reported; never let it go backwards.
+	 */
+	now = drmmode_monotonic_usec();
+	if (now > ust)
+		frames = (now - ust) / drmmode_crtc->vbl_period;
+	if (msc + frames < drmmode_crtc->vbl_soft_msc)
+		msc = drmmode_crtc->vbl_soft_msc - frames;
+
+	drmmode_crtc->vbl_msc = msc;
+	drmmode_crtc->vbl_ust = ust;
+}
+
+static CARD32
+drmmode_soft_vblank_timer(OsTimerPtr timer, CARD32 time, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_soft_vblank **pevent = &drmmode->soft_vblanks;
+	struct drmmode_soft_vblank *event;
+	uint64_t now = drmmode_monotonic_usec();
+	uint64_t ust, msc, wait, next = 0;
+
+	while ((event = *pevent)) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				event->crtc->driver_private;
+
+		drmmode_crtc_soft_clock(event->crtc, now, &ust, &msc);
+		if (msc < event->target_msc) {
+			wait = ust + (event->target_msc - msc) *
+					drmmode_crtc->vbl_period - now;
+			if (!next || wait < next)
+				next = wait;
+			pevent = &event->next;
 			continue;
+		}
 
-		drmmode_set_mode_major(crtc, &crtc->mode,
-				crtc->rotation, crtc->x, crtc->y);
+		*pevent = event->next;
+		ARMSOCDRI2VBlankHandler(msc, ust, FALSE, event->data);
+		free(event);
 	}
 
-	TRACE_EXIT();
-	return TRUE;
+	drmmode->soft_vblank_deadline = next ? now + next : 0;
+	/* in milliseconds, rounded up so we don't wake up too early */
+	return next ? max((next + 999) / 1000, 1) : 0;
+}
 
-fail:
-	TRACE_EXIT();
-	return FALSE;
+static int
+drmmode_soft_vblank_queue(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t target_msc, void *data)
+{
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_soft_vblank *event;
+	uint64_t now = drmmode_monotonic_usec();
+	uint64_t ust, msc, wait = 0;
+
+	event = calloc(1, sizeof(*event));
+	if (!event) {
+		errno = ENOMEM;
+		return -1;
+	}
+	event->crtc = crtc;
+	event->target_msc = target_msc;
+	event->data = data;
+	event->next = drmmode->soft_vblanks;
+	drmmode->soft_vblanks = event;
+
+	drmmode_crtc_soft_clock(crtc, now, &ust, &msc);
+	if (target_msc > msc)
+		wait = ust + (target_msc - msc) * drmmode_crtc->vbl_period -
+				now;
+
+	/* Only ever bring the timer forward; when it fires it works out
+	 * the next wakeup for everything still waiting.
+	 */
+	if (!drmmode->soft_vblank_deadline ||
+	    now + wait < drmmode->soft_vblank_deadline) {
+		drmmode->soft_vblank_deadline = now + wait;
+		drmmode->soft_vblank_timer = TimerSet(
+				drmmode->soft_vblank_timer, 0,
+				max((wait + 999) / 1000, 1),
+				drmmode_soft_vblank_timer, pScrn);
+	}
+	return 0;
 }
 
-static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
-		.resize = drmmode_xf86crtc_resize
-};
+/**
+ * Feed a vblank seen in a flip or vblank event into the CRTC's clock
+ * model. A NULL crtc means the first CRTC, as in vblank requests.
+ */
+void
+drmmode_crtc_note_vblank(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t msc, uint64_t ust)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 
+	crtc = drmmode_vblank_crtc(pScrn, crtc);
+	if (!crtc)
+		return;
 
-Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd, int cpp)
+	if (pARMSOC->drmmode_interface->vblank_query_supported)
+		drmmode_crtc_sync_clock(crtc, msc, ust, FALSE);
+	else
+		drmmode_crtc_soft_lock(crtc, ust);
+}
+
+/**
+ * Extend a 32-bit vblank counter from the legacy interfaces to 64 bits,
+ * using the last counter we know of to place it across wrap-arounds.
+ */
+uint64_t
+drmmode_crtc_widen_msc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, uint32_t sequence)
 {
-	struct drmmode_rec *drmmode;
-	int i;
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	int32_t delta;
 
-	TRACE_ENTER();
+	crtc = drmmode_vblank_crtc(pScrn, crtc);
+	if (!crtc)
+		return sequence;
 
-	drmmode = calloc(1, sizeof(*drmmode));
-	if (!drmmode)
-		return FALSE;
+	drmmode_crtc = crtc->driver_private;
+	delta = (int32_t)(sequence - (uint32_t)drmmode_crtc->vbl_msc);
+	if (delta < 0 && (uint64_t)-(int64_t)delta > drmmode_crtc->vbl_msc)
+		return sequence;
+	return drmmode_crtc->vbl_msc + delta;
+}
 
-	drmmode->fd = fd;
+static Bool
+drmmode_crtc_query_vblank(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t *ust, uint64_t *msc)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc = crtc->driver_private;
+	struct drmmode_rec *drmmode = drmmode_crtc->drmmode;
+	drmVBlank vbl = { .request = {
+		.type = DRM_VBLANK_RELATIVE | drmmode_crtc_vblank_pipe(crtc),
+		.sequence = 0,
+	} };
+	int ret;
 
-	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+	if (drmmode->crtc_sequence_supported) {
+		uint64_t ns;
 
+		if (!drmCrtcGetSequence(drmmode->fd, drmmode_crtc->crtc_id,
+				msc, &ns)) {
+			*ust = ns / 1000;
+			return TRUE;
+		}
+	}
+#endif
 
-	drmmode->cpp = cpp;
-	drmmode->mode_res = drmModeGetResources(drmmode->fd);
-	if (!drmmode->mode_res) {
-		free(drmmode);
+	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
+	if (ret) {
+		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
 		return FALSE;
-	} else {
-		DEBUG_MSG("Got KMS resources");
-		DEBUG_MSG("  %d connectors, %d encoders",
-				drmmode->mode_res->count_connectors,
-				drmmode->mode_res->count_encoders);
-		DEBUG_MSG("  %d crtcs, %d fbs",
-				drmmode->mode_res->count_crtcs,
-				drmmode->mode_res->count_fbs);
-		DEBUG_MSG("  %dx%d minimum resolution",
-				drmmode->mode_res->min_width,
-				drmmode->mode_res->min_height);
-		DEBUG_MSG("  %dx%d maximum resolution",
-				drmmode->mode_res->max_width,
-				drmmode->mode_res->max_height);
 	}
-	xf86CrtcSetSizeRange(pScrn, 320, 200, drmmode->mode_res->max_width,
-			drmmode->mode_res->max_height);
 
-	if (ARMSOCPTR(pScrn)->crtcNum == -1) {
-		INFO_MSG("Adding all CRTCs");
-		for (i = 0; i < drmmode->mode_res->count_crtcs; i++)
-			drmmode_crtc_init(pScrn, drmmode, i);
-	} else if (ARMSOCPTR(pScrn)->crtcNum < drmmode->mode_res->count_crtcs) {
-		drmmode_crtc_init(pScrn, drmmode, ARMSOCPTR(pScrn)->crtcNum);
-	} else {
-		ERROR_MSG(
-				"Specified more Screens in xorg.conf than there are DRM CRTCs");
+	if (drmmode->crtc_sequence_supported) {
+		INFO_MSG("CRTC sequence ioctls not supported, using 32-bit vblank counters");
+		drmmode->crtc_sequence_supported = FALSE;
+	}
+
+	*msc = drmmode_crtc_widen_msc(pScrn, crtc, vbl.reply.sequence);
+	*ust = (uint64_t)vbl.reply.tval_sec * 1000000 + vbl.reply.tval_usec;
+	return TRUE;
+}
+
+/**
+ * Get the current vblank counter and the time of the last vblank of a
+ * CRTC. The answer is extrapolated from recent vblank events when we can,
+ * and only asks the kernel when the model is stale or the CRTC has been
+ * reconfigured.
+ */
+Bool
+drmmode_crtc_get_msc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t *ust, uint64_t *msc)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	uint64_t now, frames;
+
+	crtc = drmmode_vblank_crtc(pScrn, crtc);
+	if (!crtc)
 		return FALSE;
+
+	drmmode_crtc = crtc->driver_private;
+	now = drmmode_monotonic_usec();
+	if (!pARMSOC->drmmode_interface->vblank_query_supported) {
+		drmmode_crtc_soft_clock(crtc, now, ust, msc);
+		return TRUE;
 	}
 
-	if (ARMSOCPTR(pScrn)->crtcNum != -1) {
-		if (ARMSOCPTR(pScrn)->crtcNum <
-				drmmode->mode_res->count_connectors)
-			drmmode_output_init(pScrn,
-					drmmode, ARMSOCPTR(pScrn)->crtcNum);
-		else
-			return FALSE;
-	} else {
-		for (i = 0; i < drmmode->mode_res->count_connectors; i++)
-			drmmode_output_init(pScrn, drmmode, i);
+	if (drmmode_crtc->vbl_valid && drmmode_crtc->vbl_period &&
+	    drmmode_crtc->vbl_serial == pARMSOC->crtc_config_serial &&
+	    now >= drmmode_crtc->vbl_ust &&
+	    now - drmmode_crtc->vbl_ust < ARMSOC_VBLANK_RESYNC_USEC) {
+		frames = (now - drmmode_crtc->vbl_ust) /
+				drmmode_crtc->vbl_period;
+		*msc = drmmode_crtc->vbl_msc + frames;
+		*ust = drmmode_crtc->vbl_ust +
+				frames * drmmode_crtc->vbl_period;
+		return TRUE;
 	}
-	drmmode_clones_init(pScrn, drmmode);
 
-	xf86InitialConfiguration(pScrn, TRUE);
+	if (!drmmode_crtc_query_vblank(pScrn, crtc, ust, msc)) {
+		drmmode_crtc->vbl_valid = FALSE;
+		return FALSE;
+	}
 
-	TRACE_EXIT();
+	drmmode_crtc_sync_clock(crtc, *msc, *ust, TRUE);
 
 	return TRUE;
 }
 
+/**
+ * Ask for a vblank event on a CRTC once its counter reaches target_msc.
+ * The event is passed to ARMSOCDRI2VBlankHandler() with data.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int
+drmmode_crtc_queue_vblank(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		uint64_t target_msc, void *data)
+{
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_crtc_private_rec *drmmode_crtc;
+	struct drmmode_rec *drmmode;
+	drmVBlank vbl = { .request = {
+		.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT,
+		/* The kernel compares 32-bit counters modulo wrap-around,
+		 * so the low bits are enough for any sensible target.
+		 */
+		.sequence = (uint32_t)target_msc,
+		.signal = (unsigned long)data,
+	} };
+	int ret;
+
+	crtc = drmmode_vblank_crtc(pScrn, crtc);
+	if (!crtc) {
+		errno = EINVAL;
+		return -1;
+	}
+	drmmode_crtc = crtc->driver_private;
+	drmmode = drmmode_crtc->drmmode;
+
+	if (!pARMSOC->drmmode_interface->vblank_query_supported)
+		return drmmode_soft_vblank_queue(pScrn, crtc, target_msc, data);
+
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+	if (drmmode->crtc_sequence_supported) {
+		ret = drmCrtcQueueSequence(drmmode->fd, drmmode_crtc->crtc_id,
+				0, target_msc, NULL, (uint64_t)(uintptr_t)data);
+		if (!ret)
+			return 0;
+	}
+#endif
+
+	vbl.request.type |= drmmode_crtc_vblank_pipe(crtc);
+	ret = drmWaitVBlank(pARMSOC->drmFD, &vbl);
+	if (!ret && drmmode->crtc_sequence_supported) {
+		INFO_MSG("CRTC sequence ioctls not supported, using 32-bit vblank counters");
+		drmmode->crtc_sequence_supported = FALSE;
+	}
+	return ret;
+}
+
+/**
+ * Find out whether the kernel answers vblank queries. The query fails on a
+ * CRTC that is off whatever the kernel supports, so it is only asked on a
+ * lit one; until there is one the software vblank source stands in, and
+ * this is tried again after each modeset.
+ */
 void
-drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
+drmmode_vblank_probe(ScrnInfoPtr pScrn)
 {
+	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
 	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86OutputPtr output = config->output[config->compat_output];
-	xf86CrtcPtr crtc = output->crtc;
+	xf86CrtcPtr crtc = NULL;
+	drmVBlank vbl = { .request = {
+		.type = DRM_VBLANK_RELATIVE,
+		.sequence = 0,
+	} };
+	int i;
 
-	if (!crtc || !crtc->enabled)
+	if (drmmode->vblank_probed)
+		return;
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		if (config->crtc[i]->enabled && drmmode_crtc->scanout_fb_id &&
+		    drmmode_crtc->dpms_mode == DPMSModeOn) {
+			crtc = config->crtc[i];
+			break;
+		}
+	}
+
+	if (!crtc) {
+		DEBUG_MSG("No CRTC is on, using software vblank timing until one is");
+		pARMSOC->drmmode_interface->vblank_query_supported = 0;
 		return;
+	}
+
+	drmmode->vblank_probed = TRUE;
+	vbl.request.type |= drmmode_crtc_vblank_pipe(crtc);
+	if (drmWaitVBlank(pARMSOC->drmFD, &vbl)) {
+		INFO_MSG("vblank queries not supported, using software vblank timing");
+		return;
+	}
 
-	drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+	/* The software clock counted in a space of its own */
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		drmmode_crtc->vbl_valid = FALSE;
+	}
+	pARMSOC->drmmode_interface->vblank_query_supported = 1;
 }
 
 /*
@@ -1732,24 +4345,62 @@ static void
 page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
 		unsigned int tv_usec, void *user_data)
 {
-	ARMSOCDRI2SwapComplete(user_data);
+	if (drmmode_crtc_scanout_flipped(user_data))
+		return;
+	ARMSOCDRI2FlipHandler(sequence, tv_sec, tv_usec, 0, user_data);
+}
+
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+/* Newer kernels tell us which CRTC flipped, which lets the flip
+ * timestamps feed the vblank clock model.
+ */
+static void
+page_flip_handler2(int fd, unsigned int sequence, unsigned int tv_sec,
+		unsigned int tv_usec, unsigned int crtc_id, void *user_data)
+{
+	if (drmmode_crtc_scanout_flipped(user_data))
+		return;
+	ARMSOCDRI2FlipHandler(sequence, tv_sec, tv_usec, crtc_id, user_data);
 }
+#endif
 
 static void
 vblank_handler(int fd, unsigned int sequence, unsigned int tv_sec,
 		unsigned int tv_usec, void *user_data)
 {
-	ARMSOCDRI2VBlankHandler(sequence, tv_sec, tv_usec, user_data);
+	ARMSOCDRI2VBlankHandler(sequence,
+			(uint64_t)tv_sec * 1000000 + tv_usec, TRUE, user_data);
+}
+
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+static void
+sequence_handler(int fd, uint64_t sequence, uint64_t ns, uint64_t user_data)
+{
+	ARMSOCDRI2VBlankHandler(sequence, ns / 1000, FALSE,
+			(void *)(uintptr_t)user_data);
 }
+#endif
 
 static drmEventContext event_context = {
 		.version = DRM_EVENT_CONTEXT_VERSION,
 		.page_flip_handler = page_flip_handler,
+#if DRM_EVENT_CONTEXT_VERSION >= 3
+		.page_flip_handler2 = page_flip_handler2,
+#endif
 		.vblank_handler = vblank_handler,
+#if DRM_EVENT_CONTEXT_VERSION >= 4
+		.sequence_handler = sequence_handler,
+#endif
 };
 
+/**
+ * Flip the CRTCs showing draw to fb_id. With *async set the flips are
+ * tried without waiting for vblank first; on return *async says whether
+ * any CRTC was flipped that way. Returns the number of CRTCs flipped, or
+ * minus one more than that if any flip failed.
+ */
 int
-drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
+drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv, Bool *async)
 {
 	ScreenPtr pScreen = draw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
@@ -1759,26 +4410,76 @@ drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
 	struct drmmode_rec *mode = crtc->drmmode;
 	int ret, i, failed = 0, num_flipped = 0;
 	unsigned int flags = 0;
+	uint32_t crtc_mask = 0;
+	Bool try_async = *async;
+
+	*async = FALSE;
 
 	if (pARMSOC->drmmode_interface->use_page_flip_events)
 		flags |= DRM_MODE_PAGE_FLIP_EVENT;
 
-	/* if we can flip, we must be fullscreen.. so flip all CRTC's.. */
+	/* Flip the CRTCs that are scanning out. Those that are off keep
+	 * what they had and don't hold up the swap. Only drawables that
+	 * cover the whole screen are flipped, so every lit CRTC shows it.
+	 */
 	for (i = 0; i < config->num_crtc; i++) {
 		crtc = config->crtc[i]->driver_private;
 
-		if (!config->crtc[i]->enabled)
+		if (!config->crtc[i]->enabled || !crtc->scanout_fb_id)
+			continue;
+
+		crtc_mask |= 1 << i;
+	}
+
+	/* With atomic modesetting all the CRTCs flip in one commit, so
+	 * they change buffers on the same vblank or not at all. */
+	if (mode->atomic && !try_async && crtc_mask) {
+		if (!drmmode_atomic_flip(pScrn, crtc_mask, fb_id, flags, priv)) {
+			for (i = 0; i < config->num_crtc; i++) {
+				if (!(crtc_mask & (1 << i)))
+					continue;
+				crtc = config->crtc[i]->driver_private;
+				crtc->scanout_fb_id = fb_id;
+				num_flipped += 1;
+			}
+			return num_flipped;
+		}
+		DEBUG_MSG("atomic flip failed: %s", strerror(errno));
+	}
+
+	for (i = 0; i < config->num_crtc; i++) {
+		if (!(crtc_mask & (1 << i)))
 			continue;
 
-		ret = drmModePageFlip(mode->fd, crtc->crtc_id,
-				fb_id, flags, priv);
+		crtc = config->crtc[i]->driver_private;
+
+		ret = -1;
+#ifdef DRM_MODE_PAGE_FLIP_ASYNC
+		if (try_async && mode->async_flip_supported) {
+			ret = drmModePageFlip(mode->fd, crtc->crtc_id,
+					fb_id, flags | DRM_MODE_PAGE_FLIP_ASYNC,
+					priv);
+			/* Some configurations can't be flipped
+			 * asynchronously; queue a normal flip instead. */
+			if (ret)
+				DEBUG_MSG("async flip failed: %s",
+						strerror(errno));
+			else
+				*async = TRUE;
+		}
+#endif
+		if (ret)
+			ret = drmModePageFlip(mode->fd, crtc->crtc_id,
+					fb_id, flags, priv);
 		if (ret) {
 			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
 					"flip queue failed: %s\n",
 					strerror(errno));
 			failed = 1;
-		} else
+		} else {
+			crtc->scanout_fb_id = fb_id;
 			num_flipped += 1;
+		}
 	}
 
 	if (failed)
@@ -1787,6 +4488,91 @@ drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv)
 		return num_flipped;
 }
 
+/*
+ * Whether the kernel's state of a connector is still what we last saw,
+ * found without probing the display.
+ */
+static Bool
+drmmode_output_unchanged(struct drmmode_rec *drmmode,
+		struct drmmode_output_priv *drmmode_output)
+{
+#ifdef HAVE_DRMMODEGETCONNECTORCURRENT
+	drmModeConnectorPtr old = drmmode_output->connector;
+	drmModeConnectorPtr cur;
+	Bool same;
+
+	cur = drmModeGetConnectorCurrent(drmmode->fd,
+			drmmode_output->output_id);
+	if (!cur)
+		return FALSE;
+
+	/* a new EDID or link-status shows in the property values */
+	same = cur->connection == old->connection &&
+		cur->count_modes == old->count_modes &&
+		cur->count_props == old->count_props &&
+		(!cur->count_modes || !memcmp(cur->modes, old->modes,
+				cur->count_modes * sizeof(*cur->modes))) &&
+		(!cur->count_props || (!memcmp(cur->props, old->props,
+				cur->count_props * sizeof(*cur->props)) &&
+			!memcmp(cur->prop_values, old->prop_values,
+				cur->count_props * sizeof(*cur->prop_values))));
+
+	drmModeFreeConnector(cur);
+	return same;
+#else
+	/* we can't tell without probing the display */
+	return FALSE;
+#endif
+}
+
+/*
+ * Marks the outputs a hotplug event left as they were, so that the probe
+ * which follows doesn't probe their displays and parse their EDID again.
+ * Newer kernels name the connector in the event; otherwise we compare the
+ * kernel's state of each connector with ours. Returns FALSE if the event
+ * concerns none of our outputs.
+ */
+static Bool
+drmmode_hotplug_mark_outputs(ScrnInfoPtr pScrn, struct udev_device *dev)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	const char *str;
+	uint32_t connector_id = 0;
+	int i, changed = 0;
+
+	str = udev_device_get_property_value(dev, "CONNECTOR");
+	if (str)
+		connector_id = strtoul(str, NULL, 10);
+
+	for (i = 0; i < xf86_config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				xf86_config->output[i]->driver_private;
+
+		if (connector_id)
+			drmmode_output->unchanged =
+				drmmode_output->output_id != connector_id;
+		else
+			drmmode_output->unchanged =
+				drmmode_output_unchanged(drmmode,
+						drmmode_output);
+		if (!drmmode_output->unchanged)
+			changed++;
+	}
+
+	if (changed || connector_id)
+		return changed > 0;
+
+	/* nothing we can see changed, so probe everything to be safe */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				xf86_config->output[i]->driver_private;
+
+		drmmode_output->unchanged = FALSE;
+	}
+	return TRUE;
+}
+
 /*
  * Hot Plug Event handling:
  * TODO: MIDEGL-1441: Do we need to keep this handler, which
@@ -1798,10 +4584,12 @@ drmmode_handle_uevents(int fd, void *closure)
 	ScrnInfoPtr pScrn = closure;
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
 	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	struct udev_device *dev;
 	const char *hotplug;
 	struct stat s;
 	dev_t udev_devnum;
+	int i;
 
 	dev = udev_monitor_receive_device(drmmode->uevent_monitor);
 	if (!dev)
@@ -1825,9 +4613,18 @@ drmmode_handle_uevents(int fd, void *closure)
 			!memcmp(&s.st_rdev, &udev_devnum, sizeof(dev_t)));
 
 	if (memcmp(&s.st_rdev, &udev_devnum, sizeof(dev_t)) == 0 &&
-			hotplug && atoi(hotplug) == 1) {
+			hotplug && atoi(hotplug) == 1 &&
+			drmmode_hotplug_mark_outputs(pScrn, dev)) {
 		RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
 	}
+
+	/* later probes, as asked for by clients, probe every output */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		struct drmmode_output_priv *drmmode_output =
+				xf86_config->output[i]->driver_private;
+
+		drmmode_output->unchanged = FALSE;
+	}
 	udev_device_unref(dev);
 }
 
@@ -1932,6 +4729,39 @@ void
 drmmode_screen_fini(ScrnInfoPtr pScrn)
 {
 	struct ARMSOCRec *pARMSOC = ARMSOCPTR(pScrn);
+	struct drmmode_rec *drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_soft_vblank *event;
+	int i;
+
 	drmmode_uevent_fini(pScrn);
 	drmmode_fini_wakeup_handler(pARMSOC);
+	drmmode_retire_fb(pScrn);
+
+	for (i = 0; i < config->num_crtc; i++) {
+		struct drmmode_crtc_private_rec *drmmode_crtc =
+				config->crtc[i]->driver_private;
+
+		drmmode_crtc_scanout_wait(config->crtc[i]);
+		if (drmmode_crtc->scanout) {
+			armsoc_bo_unreference(drmmode_crtc->scanout);
+			drmmode_crtc->scanout = NULL;
+		}
+		if (drmmode_crtc->scanout_back) {
+			armsoc_bo_unreference(drmmode_crtc->scanout_back);
+			drmmode_crtc->scanout_back = NULL;
+		}
+		RegionEmpty(&drmmode_crtc->scanout_damage);
+		RegionEmpty(&drmmode_crtc->scanout_stale);
+	}
+
+	TimerFree(drmmode->soft_vblank_timer);
+	drmmode->soft_vblank_timer = NULL;
+	drmmode->soft_vblank_deadline = 0;
+	while ((event = drmmode->soft_vblanks)) {
+		drmmode->soft_vblanks = event->next;
+		/* the WaitMSC command that would have been completed */
+		free(event->data);
+		free(event);
+	}
 }
@@ -97,6 +97,12 @@ struct drmmode_interface {
 	 * @return 0 on success, non-zero on failure
 	 */
 	int (*create_custom_gem)(int fd, struct armsoc_create_gem *create_gem);
+
+	/* Boolean value indicating whether GEM objects created by
+	 * create_custom_gem are always zero-filled by the kernel, so
+	 * newly allocated buffers need not be cleared
+	 */
+	int zeroed_allocations;
 };
 
 struct drmmode_interface *drmmode_interface_get_implementation(int drm_fd);
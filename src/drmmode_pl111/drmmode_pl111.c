@@ -115,6 +115,7 @@ struct drmmode_interface pl111_interface = {
 	NULL                  /* init_plane_for_cursor */,
 	0                     /* vblank_query_supported */,
 	create_custom_gem     /* create_custom_gem */,
+	0                     /* zeroed_allocations */,
 };
 
 struct drmmode_interface *drmmode_interface_get_implementation(int drm_fd)
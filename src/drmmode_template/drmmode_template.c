@@ -62,6 +62,7 @@ struct drmmode_interface template_interface = {
 	init_plane_for_cursor /* init_plane_for_cursor */,
 	0                     /* vblank_query_supported */,
 	create_custom_gem     /* create_custom_gem */,
+	0                     /* zeroed_allocations */,
 };
 
 struct drmmode_interface *drmmode_interface_get_implementation(int drm_fd)